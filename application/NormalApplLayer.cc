@@ -59,6 +59,20 @@ void NormalApplLayer::initialize(int stage) {
 		initializationTime = par("initializationTime");
 		broadcastPackets = par("broadcastPackets");
 		headerLength = par("headerLength");
+		trafficClass = hasPar("trafficClass") ? par("trafficClass") : 0;
+		payloadSize = hasPar("payloadSize") ? par("payloadSize") : 0;
+		payloadMin = hasPar("payloadMin") ? par("payloadMin") : 0;
+		payloadType = PAYLOAD_CONSTANT;
+		if (hasPar("payloadType")) {
+			std::string payload = par("payloadType").stdstringValue();
+			if (payload == "uniform") {
+				payloadType = PAYLOAD_UNIFORM;
+			} else if (payload == "exponential") {
+				payloadType = PAYLOAD_EXPONENTIAL;
+			} else if (payload != "constant") {
+				EV << "Error! Unknown payload type: " << payload << endl;
+			}
+		}
 		// application configuration
 		const char *traffic = par("trafficType");
 		destAddr = LAddress::L3Type(par("destAddr").longValue());
@@ -160,6 +174,8 @@ void NormalApplLayer::initialize(int stage) {
 			latenciesRaw.setName("rawLatencies");
 			latenciesRaw.setUnit("s");
 			latency.setName("latency");
+			aoiRaw.setName("aoi");
+			aoiRaw.setUnit("s");
 		}
 		iwuVec.setName("Iwu");
 		iwuVec.setUnit("ms");
@@ -180,6 +196,40 @@ cStdDev& NormalApplLayer::hostsLatency(const LAddress::L3Type& hostAddress)
 	return latencies[hostAddress];
 }
 
+/**
+ * The age of a source grows linearly between two updates and drops to the
+ * age of the newest reading on each update, the area under this curve gives
+ * the average age & the value just before an update is a peak age.
+ */
+void NormalApplLayer::updateAoI(const LAddress::L3Type& hostAddress, simtime_t generation)
+{
+	simtime_t now = simTime();
+	if (aoi.count(hostAddress) == 0) {
+		AoIStats source;
+		source.firstUpdate = source.lastUpdate = now;
+		source.lastGeneration = generation;
+		source.area = 0;
+		source.peak = SIMTIME_DBL(now - generation);
+		aoi[hostAddress] = source;
+		return;
+	}
+	AoIStats& source = aoi[hostAddress];
+	double peak = SIMTIME_DBL(now - source.lastGeneration);
+	double start = SIMTIME_DBL(source.lastUpdate - source.lastGeneration);
+	source.area += (peak * peak - start * start) / 2;
+	if (peak > source.peak) {
+		source.peak = peak;
+	}
+	// an older reading received late does not refresh the source
+	if (generation > source.lastGeneration) {
+		source.lastGeneration = generation;
+	}
+	source.lastUpdate = now;
+	if (trace) {
+		aoiRaw.record(peak);
+	}
+}
+
 void NormalApplLayer::initializeDistribution(const char* traffic) {
 	if (!strcmp(traffic, "periodic")) {
 		trafficType = PERIODIC;
@@ -202,6 +252,17 @@ void NormalApplLayer::initializeDistribution(const char* traffic) {
 	}
 }
 
+int NormalApplLayer::getPayloadLength() {
+	switch (payloadType) {
+		case PAYLOAD_UNIFORM:
+			return intuniform(payloadMin, payloadSize);
+		case PAYLOAD_EXPONENTIAL:
+			return int(round(exponential(payloadSize)));
+		default:
+			return payloadSize;
+	}
+}
+
 void NormalApplLayer::scheduleNextPacket() {
 	if (nbPackets > sentPackets && trafficType != 0) { // We must generate packets
 
@@ -269,6 +330,7 @@ void NormalApplLayer::handleLowerMsg(cMessage * msg) {
 			  latenciesRaw.record(SIMTIME_DBL(theLatency));
 			}
 			latency.collect(theLatency);
+			updateAoI(m->getSrcAddr(), m->getCreationTime());
 			if (firstPacketGeneration < 0)
 				firstPacketGeneration = m->getCreationTime();
 			lastPacketReception = m->getArrivalTime();
@@ -332,7 +394,15 @@ void NormalApplLayer::sendData() {
 		pkt->setDestAddr(destAddr);
 	}
 	pkt->setSrcAddr(myAppAddr);
-	pkt->setByteLength(headerLength);
+	pkt->setByteLength(headerLength + getPayloadLength());
+	// the network layer replaces the control info: the class travels with the packet
+	pkt->addPar("trafficClass").setLongValue(trafficClass);
+	// plan the next packet first: the MAC gets its exact send time with this one
+	sentPackets++;
+	scheduleNextPacket();
+	if (delayTimer->isScheduled()) {
+		pkt->addPar("nextSendTime").setDoubleValue(delayTimer->getArrivalTime().dbl());
+	}
 	// set the control info to tell the network layer the layer 3 address
 	NetwControlInfo::setControlInfo(pkt, pkt->getDestAddr());
 	debugEV<< "Sending data packet!\n";
@@ -343,8 +413,6 @@ void NormalApplLayer::sendData() {
 	packet.setNbPacketsReceived(0);
 	packet.setHost(myAppAddr);
 	emit(BaseLayer::catPacketSignal, &packet);
-	sentPackets++;
-	scheduleNextPacket();
 	if (firstPacketGeneration < 0) {
 	    firstPacketGeneration = simTime();
 	}
@@ -364,6 +432,16 @@ void NormalApplLayer::finish() {
 				aLatency.record();
 			}
 		}
+		std::stringstream osToStr(std::stringstream::out);
+		for (map<LAddress::L3Type, AoIStats>::iterator it = aoi.begin(); it != aoi.end(); ++it) {
+			AoIStats& source = it->second;
+			double duration = SIMTIME_DBL(source.lastUpdate - source.firstUpdate);
+
+			osToStr.str(""); osToStr << "aoiMean" << it->first;
+			recordScalar(osToStr.str().c_str(), duration > 0 ? source.area / duration : 0, "s");
+			osToStr.str(""); osToStr << "aoiPeak" << it->first;
+			recordScalar(osToStr.str().c_str(), source.peak, "s");
+		}
 		recordScalar("activity duration", lastPacketReception
 				- firstPacketGeneration, "s");
 		recordScalar("firstPacketGeneration", firstPacketGeneration, "s");
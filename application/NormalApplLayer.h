@@ -89,6 +89,11 @@ class MIXIM_API NormalApplLayer : public BaseLayer
             UNKNOWN = 0, NORMAL, PERIODIC, UNIFORM, EXPONENTIAL, NB_DISTRIBUTIONS, VARIABLE
         };
 
+        enum PAYLOAD_TYPES
+        {
+            PAYLOAD_CONSTANT = 0, PAYLOAD_UNIFORM, PAYLOAD_EXPONENTIAL
+        };
+
     protected:
         cMessage * delayTimer;
         LAddress::L3Type myAppAddr;
@@ -112,8 +117,24 @@ class MIXIM_API NormalApplLayer : public BaseLayer
         std::map<LAddress::L3Type, cStdDev> latencies;
         cStdDev latency;
         cOutVector latenciesRaw;
+        /** @brief Age of information of one source: area under the age curve and peak age */
+        struct AoIStats {
+            simtime_t firstUpdate;
+            simtime_t lastUpdate;
+            simtime_t lastGeneration;
+            double area;
+            double peak;
+        };
+        std::map<LAddress::L3Type, AoIStats> aoi;
+        cOutVector aoiRaw;
         Packet packet; // informs the simulation of the number of packets sent and received by this node.
         int headerLength;
+        /** @brief MAC traffic class of the packets, 0 is served first */
+        int trafficClass;
+        /** @brief Payload size distribution, the packet is headerLength + payload bytes */
+        int payloadType;
+        int payloadSize;
+        int payloadMin;
         BaseWorldUtility* world;
 
         int currentWakeupIdx;
@@ -158,6 +179,9 @@ class MIXIM_API NormalApplLayer : public BaseLayer
         /** @brief Recognize distribution name. Redefine this method to add your own distribution. */
         virtual void initializeDistribution(const char*);
 
+        /** @brief Draw the payload size of the next packet in bytes */
+        virtual int getPayloadLength();
+
         /** @brief calculate time to wait before sending next packet, if required. You can redefine this method in a subclass to add your own distribution. */
         virtual void scheduleNextPacket();
 
@@ -167,6 +191,13 @@ class MIXIM_API NormalApplLayer : public BaseLayer
          * @return A reference to the hosts latency statistics.
          */
         cStdDev& hostsLatency(const LAddress::L3Type& hostAddress);
+
+        /**
+         * @brief Updates the age of information of a source with a received packet.
+         * @param hostAddress the address of the source.
+         * @param generation the creation time of the received packet.
+         */
+        void updateAoI(const LAddress::L3Type& hostAddress, simtime_t generation);
 };
 
 #endif
@@ -35,6 +35,7 @@
 #include <time.h>
 #include <MacPkt_m.h>
 #include "tool.h"
+#include <algorithm>
 #include "BaseDecider.h"
 #include "Decider802154Narrow.h"
 
@@ -66,17 +67,142 @@ void FTAMacLayer::initialize(int stage) {
         numberSender = hasPar("numberSender") ? par("numberSender") : 1;
         dataLen = hasPar("dataLen") ? par("dataLen") : 13;
 
+        useAdaptiveStep = hasPar("useAdaptiveStep") ? par("useAdaptiveStep") : false;
+        stepIncrease = hasPar("stepIncrease") ? par("stepIncrease") : 5;
+        stepDecrease = hasPar("stepDecrease") ? par("stepDecrease") : 0.5;
+        stepMin = hasPar("stepMin") ? par("stepMin") : 1;
+        stepMax = hasPar("stepMax") ? par("stepMax") : 500;
+        useWeightedTSR = hasPar("useWeightedTSR") ? par("useWeightedTSR") : false;
+        tsrLevels = hasPar("tsrLevels") ? par("tsrLevels") : 4;
+        useLatencySLO = hasPar("useLatencySLO") ? par("useLatencySLO") : false;
+        useBootstrap = hasPar("useBootstrap") ? par("useBootstrap") : false;
+        bootstrapSamples = hasPar("bootstrapSamples") ? par("bootstrapSamples") : 2;
+        useAoI = hasPar("useAoI") ? par("useAoI") : false;
+        aoiMaxWakeRate = hasPar("aoiMaxWakeRate") ? par("aoiMaxWakeRate") : 0;
+        useDormancy = hasPar("useDormancy") ? par("useDormancy") : false;
+        dormantThreshold = hasPar("dormantThreshold") ? par("dormantThreshold") : 8;
+        dormantMaxInterval = hasPar("dormantMaxInterval") ? par("dormantMaxInterval") : 1;
+
+        deferTransmission = hasPar("deferTransmission") ? par("deferTransmission") : false;
+        // only a leaf sender can hold its data, a transmitter also relays
+        if (role != NODE_SENDER) {
+            deferTransmission = false;
+        }
+        maxHoldTime = hasPar("maxHoldTime") ? par("maxHoldTime") : 1;
+        advertGuard = hasPar("advertGuard") ? par("advertGuard") : 0.005;
+
+        useFramePending = hasPar("useFramePending") ? par("useFramePending") : false;
+        maxAggregationAirtime = hasPar("maxAggregationAirtime") ? par("maxAggregationAirtime") : 0;
+        useAdaptiveWaitWB = hasPar("useAdaptiveWaitWB") ? par("useAdaptiveWaitWB") : false;
+        waitWBQuantile = hasPar("waitWBQuantile") ? par("waitWBQuantile") : 0.95;
+        waitWBMargin = hasPar("waitWBMargin") ? par("waitWBMargin") : 0.005;
+        wbProbe = false;
+        nbWBTimeouts = 0;
+        aggregated = 1;
+        burstPending = false;
+        burstNode = 0;
+        moreDataSent = false;
         queueLength = hasPar("queueLength") ? par("queueLength") : 8;
+        ackBitmap = 0;
+        ackCount = 0;
+        nbBlockAckMiss = 0;
+        useEarlySleep = hasPar("useEarlySleep") ? par("useEarlySleep") : false;
+        lostSenderTimeout = hasPar("lostSenderTimeout") ? par("lostSenderTimeout") : 0;
+        listenSaved = 0;
+        listenSavedVec.setName("listenSaved");
+        useRealLength = hasPar("useRealLength") ? par("useRealLength") : false;
+        usePerDestQueues = hasPar("usePerDestQueues") ? par("usePerDestQueues") : false;
+        useUrgentStrobe = hasPar("useUrgentStrobe") ? par("useUrgentStrobe") : false;
+        // the transmitter FSM neither strobes nor samples
+        if (role == NODE_TRANSMITER) {
+            useUrgentStrobe = false;
+        }
+        urgentClass = hasPar("urgentClass") ? par("urgentClass") : 0;
+        sampleInterval = hasPar("sampleInterval") ? par("sampleInterval") : 0.1;
+        sampleDuration = hasPar("sampleDuration") ? par("sampleDuration") : 0.004;
+        strobeInterval = hasPar("strobeInterval") ? par("strobeInterval") : 0.003;
+        strobing = false;
+        urgentWake = false;
+        nbStrobes = 0;
+        nbUrgentWakes = 0;
+        nbSamples = 0;
+        sampleTime = 0;
+        urgentDelayVec.setName("urgentDelay");
+        nbOverheardWB = 0;
+        nbSkippedListen = 0;
+        useBackoff = hasPar("useBackoff") ? par("useBackoff") : false;
+        backoffSlot = hasPar("backoffSlot") ? par("backoffSlot") : 0.00032;
+        minBE = hasPar("minBE") ? par("minBE") : 2;
+        maxBE = hasPar("maxBE") ? par("maxBE") : 5;
+        maxCCAattempts = hasPar("maxCCAattempts") ? par("maxCCAattempts") : 2;
+        backoffExponent = minBE;
+        nbCCAFailures = 0;
+        useScheduleHint = hasPar("useScheduleHint") ? par("useScheduleHint") : false;
+        nextSendTime = -1;
+        dropOldest = hasPar("queueDiscipline") && par("queueDiscipline").stdstringValue() == "dropOldest";
+        maxPacketAge = hasPar("maxPacketAge") ? par("maxPacketAge") : 0;
+        destQueueLength = hasPar("destQueueLength") ? par("destQueueLength") : 0;
+        nbExpired = 0;
+        nbDroppedOldest = 0;
+        nbDestDropped = 0;
+        usePriority = hasPar("usePriority") ? par("usePriority") : false;
+        trafficClasses = hasPar("trafficClasses") ? par("trafficClasses") : 2;
+        classQueueLength = new int[trafficClasses];
+        nbClassDropped = new long[trafficClasses];
+        classDelayVec = new cOutVector[trafficClasses];
+        for (int i = 0; i < trafficClasses; i++) {
+            classQueueLength[i] = queueLength;
+            nbClassDropped[i] = 0;
+
+            ostringstream converter;
+            converter << "classDelay_" << i;
+            classDelayVec[i].setName(converter.str().c_str());
+        }
+        if (hasPar("classQueueLengths")) {
+            std::vector<int> lengths = split(par("classQueueLengths").stdstringValue(), ',');
+            for (int i = 0; i < trafficClasses && i < int(lengths.size()); i++) {
+                classQueueLength[i] = lengths[i];
+            }
+        }
         animation = hasPar("animation") ? par("animation") : true;
         bitrate = hasPar("bitrate") ? par("bitrate") : 250000.;
         headerLength = hasPar("headerLength") ? par("headerLength") : 10.;
         txPower = hasPar("txPower") ? par("txPower") : 1.;
         useMacAcks = hasPar("useMACAcks") ? par("useMACAcks") : false;
-        maxTxAttempts = hasPar("maxTxAttempts") ? par("maxTxAttempts") : 2;
+        // a block ACK is only sent when the ACKs are used
+        useBlockAck = useMacAcks && (hasPar("useBlockAck") ? par("useBlockAck").boolValue() : false);
+        // the bitmap holds one bit per sender
+        if (useBlockAck && numberSender > 8 * (int) sizeof(long) - 1) {
+            opp_error("useBlockAck supports at most %d senders (numberSender = %d)",
+                    8 * (int) sizeof(long) - 1, numberSender);
+        }
+        // the block ACK already serves the whole group
+        useAckChaining = useMacAcks && !useBlockAck
+                && (hasPar("useAckChaining") ? par("useAckChaining").boolValue() : false);
+        // the other WBs are broadcast: only a chain names the sender a WB is for
+        useOverheardWB = useAckChaining && (hasPar("useOverheardWB") ? par("useOverheardWB").boolValue() : false);
+        useCompactHeaders = hasPar("useCompactHeaders") ? par("useCompactHeaders") : false;
+        // the ACK of a group or a chain also serves as WB, its DATA need it
+        useImplicitAck = !useBlockAck && !useAckChaining
+                && (hasPar("useImplicitAck") ? par("useImplicitAck").boolValue() : false);
+        implicitAckClass = hasPar("implicitAckClass") ? par("implicitAckClass") : 0;
+        implicitAckSent = false;
+        nbImplicitAcks = 0;
+        nbImplicitRetries = 0;
+        chainPending = false;
+        nbChainedAcks = 0;
+        nbChainedWB = 0;
+        nbCCA = 0;
+        // the first transmission plus macMaxFrameRetries retransmissions
+        maxTxAttempts = (hasPar("macMaxFrameRetries") ? (int) par("macMaxFrameRetries") : 1) + 1;
 
         idxOffset = hasPar("idxOffset") ? par("idxOffset") : 0;
 
         waitCCA = PKG_DATA_SIZE / bitrate;
+        // a sample must hear at least one STROBE of the train
+        if (sampleDuration < strobeInterval + waitCCA) {
+            sampleDuration = strobeInterval + waitCCA;
+        }
 
         stats = par("stats");
         nbTxDataPackets = 0;
@@ -90,6 +216,9 @@ void FTAMacLayer::initialize(int stage) {
         numWUConvergent = 0;
 
         txAttempts = 0;
+        seqNum = 0;
+        nbRetransmissions = 0;
+        nbDuplicates = 0;
         lastDataPktDestAddr = LAddress::L2BROADCAST;
         lastDataPktSrcAddr = LAddress::L2BROADCAST;
         backHost.setAddress(hasPar("backHost") ? par("backHost") : "ff:ff:ff:ff:ff:ff");
@@ -132,6 +261,12 @@ void FTAMacLayer::initialize(int stage) {
             ACKsent = new cMessage("ACK_SENT");
             ACKsent->setKind(ACK_SENT);
 
+            sampleTimer = new cMessage("SAMPLE");
+            sampleTimer->setKind(SAMPLE);
+
+            sampleTimeout = new cMessage("SAMPLE_TIMEOUT");
+            sampleTimeout->setKind(SAMPLE_TIMEOUT);
+
             TSR_length = 4;
             // allocate memory & initialize for TSR bank
             TSR_bank = new int*[numberSender+1];
@@ -166,7 +301,11 @@ void FTAMacLayer::initialize(int stage) {
             nodeChosen = new int[numberSender+1];
             nodeBroken = new int[numberSender+1];
             nbRxData = new int[numberSender+1];
+            senderAddr = new LAddress::L2Type[numberSender+1];
+            ackPending = new bool[numberSender+1];
             for (int i = 1; i <= numberSender; i++) {
+                senderAddr[i] = LAddress::L2BROADCAST;
+                ackPending[i] = false;
                 nodeIndex[i] = 0;
                 nodeNumberWakeup[i] = 0;
                 nodeIdle[i] = new double[2];
@@ -183,6 +322,87 @@ void FTAMacLayer::initialize(int stage) {
                 iwuVec[i].setName(converter.str().c_str());
             }
 
+            // the adaptive step starts from the fixed step
+            nodeStep = new double[numberSender+1];
+            nodeMissRun = new int[numberSender+1];
+            stepVec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeStep[i] = sysClockFactor;
+                nodeMissRun[i] = 0;
+
+                ostringstream converter;
+                converter << "step_" << (i + nodeIdx);
+                stepVec[i].setName(converter.str().c_str());
+            }
+
+            // per sender latency target, targetDelays (ms) overrides targetDelay
+            double targetDelay = hasPar("targetDelay") ? par("targetDelay") : 0.1;
+            std::vector<int> targets = split(hasPar("targetDelays") ? par("targetDelays") : "", ',');
+            nodeTargetDelay = new double[numberSender+1];
+            nodeSloCap = new double[numberSender+1];
+            nodeDelay = new double*[numberSender+1];
+            nodeDelayCount = new int[numberSender+1];
+            nodeP95 = new double[numberSender+1];
+            p95Vec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeTargetDelay[i] = targetDelay;
+                if (i <= int(targets.size()) && targets[i - 1] > 0) {
+                    nodeTargetDelay[i] = targets[i - 1] / 1000.0;
+                }
+                // with uniform arrivals the p95 delay is 95% of the interval
+                nodeSloCap[i] = nodeTargetDelay[i] / 0.95;
+                nodeDelay[i] = new double[sloWindow];
+                nodeDelayCount[i] = 0;
+                nodeP95[i] = 0;
+
+                ostringstream converter;
+                converter << "p95_" << (i + nodeIdx);
+                p95Vec[i].setName(converter.str().c_str());
+            }
+
+            nodeEmptyRun = new int[numberSender+1];
+            nodeDormant = new bool[numberSender+1];
+            nodeActiveInterval = new double[numberSender+1];
+            nodeDormantInterval = new double[numberSender+1];
+            nbDormant = new long[numberSender+1];
+            nbDormantResume = new long[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeEmptyRun[i] = 0;
+                nodeDormant[i] = false;
+                nodeActiveInterval[i] = 0;
+                nodeDormantInterval[i] = 0;
+                nbDormant[i] = 0;
+                nbDormantResume[i] = 0;
+            }
+
+            nodeBootCount = new int[numberSender+1];
+            nodeBootSum = new double[numberSender+1];
+            nodeBootDone = new bool[numberSender+1];
+            firstLockTime = new double[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeBootCount[i] = 0;
+                nodeBootSum[i] = 0;
+                nodeBootDone[i] = false;
+                firstLockTime[i] = -1;
+            }
+
+            nodePeriod = new double[numberSender+1];
+            nodeLastGen = new double[numberSender+1];
+            aoiVec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodePeriod[i] = 0;
+                nodeLastGen[i] = -1;
+
+                ostringstream converter;
+                converter << "aoi_" << (i + nodeIdx);
+                aoiVec[i].setName(converter.str().c_str());
+            }
+
+            lastSeq = new long[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                lastSeq[i] = -1;
+            }
+
             sourceNode = new bool[numberSender+1];
             for (int i = 0; i <= numberSender; i++) {
                 sourceNode[i] = false;
@@ -216,6 +436,9 @@ void FTAMacLayer::initialize(int stage) {
 
                 ACKreceived = new cMessage("ACK_RECEIVED");
                 ACKreceived->setKind(ACK_RECEIVED);
+
+                strobeSent = new cMessage("STROBE_SENT");
+                strobeSent->setKind(STROBE_SENT);
             }
         } else {
             /**
@@ -244,10 +467,17 @@ void FTAMacLayer::initialize(int stage) {
 
             ACKreceived = new cMessage("ACK_RECEIVED");
             ACKreceived->setKind(ACK_RECEIVED);
+
+            strobeSent = new cMessage("STROBE_SENT");
+            strobeSent->setKind(STROBE_SENT);
+
             iwuVec = new cOutVector[2];
             iwuVec[0].setName("Iwu");
             iwuVec[1].setName("idle");
+            drainVec.setName("drainTime");
+            wbTimeoutVec.setName("wbTimeout");
             lastData = -1;
+            lastWB = -1;
             newIwu = 0;
         }
         lastWakeup = 0;
@@ -269,6 +499,8 @@ FTAMacLayer::~FTAMacLayer() {
         cancelAndDelete(DATAreceived);
         cancelAndDelete(ccaACKTimeout);
         cancelAndDelete(ACKsent);
+        cancelAndDelete(sampleTimer);
+        cancelAndDelete(sampleTimeout);
     } else {
         cancelAndDelete(start);
         cancelAndDelete(wakeupDATA);
@@ -278,6 +510,7 @@ FTAMacLayer::~FTAMacLayer() {
         cancelAndDelete(DATAsent);
         cancelAndDelete(waitACKTimeout);
         cancelAndDelete(ACKreceived);
+        cancelAndDelete(strobeSent);
     }
 
     MacQueue::iterator it;
@@ -285,6 +518,10 @@ FTAMacLayer::~FTAMacLayer() {
         delete (*it);
     }
     macQueue.clear();
+    for (it = awaitingAck.begin(); it != awaitingAck.end(); ++it) {
+        delete (*it);
+    }
+    awaitingAck.clear();
 }
 
 void FTAMacLayer::finish() {
@@ -299,6 +536,54 @@ void FTAMacLayer::finish() {
         recordScalar("nbMissedAcks", nbMissedAcks);
         recordScalar("nbRecvdAcks", nbRecvdAcks);
         recordScalar("nbTxAcks", nbTxAcks);
+        recordScalar("nbRetransmissions", nbRetransmissions);
+        recordScalar("nbDuplicates", nbDuplicates);
+        recordScalar("nbDroppedDataPackets", nbDroppedDataPackets);
+        recordScalar("nbExpired", nbExpired);
+        recordScalar("nbCCAFailures", nbCCAFailures);
+        if (useImplicitAck && role == NODE_SENDER) {
+            recordScalar("nbImplicitAcks", nbImplicitAcks);
+            recordScalar("nbImplicitRetries", nbImplicitRetries);
+        }
+        if (useEarlySleep && role != NODE_SENDER) {
+            recordScalar("listenSaved", listenSaved, "s");
+        }
+        if (useUrgentStrobe) {
+            if (role == NODE_SENDER) {
+                recordScalar("nbStrobes", nbStrobes);
+            } else {
+                recordScalar("nbUrgentWakes", nbUrgentWakes);
+                recordScalar("nbSamples", nbSamples);
+                recordScalar("sampleTime", sampleTime, "s");
+            }
+        }
+        if (useBlockAck && role == NODE_SENDER) {
+            recordScalar("nbBlockAckMiss", nbBlockAckMiss);
+        }
+        if (useAckChaining) {
+            recordScalar(role == NODE_SENDER ? "nbChainedWB" : "nbChainedAcks",
+                    role == NODE_SENDER ? nbChainedWB : nbChainedAcks);
+        }
+        if (role != NODE_SENDER && nbRxDataPackets > 0) {
+            recordScalar("ccaPerPacket", nbCCA / double(nbRxDataPackets));
+            recordScalar("wbPerPacket", nbTxWB / double(nbRxDataPackets));
+        }
+        if (role == NODE_SENDER) {
+            recordScalar("nbOverheardWB", nbOverheardWB);
+            recordScalar("nbSkippedListen", nbSkippedListen);
+        }
+        recordScalar("nbDroppedOldest", nbDroppedOldest);
+        recordScalar("nbDestDropped", nbDestDropped);
+        if (role == NODE_SENDER) {
+            recordScalar("nbWBTimeouts", nbWBTimeouts);
+            if (usePriority) {
+                for (int i = 0; i < trafficClasses; i++) {
+                    ostringstream converter;
+                    converter << "nbClassDropped_" << i;
+                    recordScalar(converter.str().c_str(), nbClassDropped[i]);
+                }
+            }
+        }
         recordScalar("numberWakeup", numberWakeup);
         recordScalar("nbCollision", nbCollision);
         recordScalar("error_radio", (numberWakeup - nbRxWB) / double(numberWakeup * 1.0) * 100.0);
@@ -309,6 +594,31 @@ void FTAMacLayer::finish() {
                 recordScalar(converter.str().c_str(), nbRxData[i]);
             }
             recordScalar("numWUConvergent", numWUConvergent);
+            for (int i = 1; i <= numberSender; i++) {
+                ostringstream converter;
+                converter << "firstLockTime_" << i;
+                recordScalar(converter.str().c_str(), firstLockTime[i], "s");
+            }
+        }
+        if (role != NODE_SENDER && useLatencySLO) {
+            for (int i = 1; i <= numberSender; i++) {
+                ostringstream converter;
+                converter << "p95Delay_" << i;
+                recordScalar(converter.str().c_str(), nodeP95[i], "s");
+                converter.str("");
+                converter << "targetDelay_" << i;
+                recordScalar(converter.str().c_str(), nodeTargetDelay[i], "s");
+            }
+        }
+        if (role != NODE_SENDER && useDormancy) {
+            for (int i = 1; i <= numberSender; i++) {
+                ostringstream converter;
+                converter << "nbDormant_" << i;
+                recordScalar(converter.str().c_str(), nbDormant[i]);
+                converter.str("");
+                converter << "nbDormantResume_" << i;
+                recordScalar(converter.str().c_str(), nbDormantResume[i]);
+            }
         }
     }
 }
@@ -322,16 +632,22 @@ cObject* FTAMacLayer::setUpControlInfo(cMessage * const pMsg, const LAddress::L2
 }
 
 bool FTAMacLayer::addToQueue(cMessage * msg) {
-    if (macQueue.size() >= queueLength) {
+    int trafficClass = getPacketClass(static_cast<cPacket*>(msg));
+    int reason = DroppedPacket::QUEUE;
+    if (!applyQueueDiscipline(getUpperDestinationFromControlInfo(msg->getControlInfo()), trafficClass, reason)
+            || (usePriority ? !makeRoom(trafficClass) : macQueue.size() >= queueLength)) {
         // queue is full, message has to be deleted
         debugEV << simTime() << ":New packet arrived, but queue is FULL, so new packet is"
                   " deleted\n";
         msg->setName("MAC ERROR");
         msg->setKind(PACKET_DROPPED);
         sendControlUp(msg);
-        droppedPacket.setReason(DroppedPacket::QUEUE);
+        droppedPacket.setReason(reason);
         emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
         nbDroppedDataPackets++;
+        if (usePriority) {
+            nbClassDropped[trafficClass]++;
+        }
 
         return false;
     }
@@ -343,6 +659,8 @@ bool FTAMacLayer::addToQueue(cMessage * msg) {
     macPkt->setDestAddr(getUpperDestinationFromControlInfo(cInfo));
     delete cInfo;
     macPkt->setSrcAddr(myMacAddr);
+    // numbered when it is sent the first time
+    macPkt->setSequenceId(-1);
 
     assert(static_cast<cPacket*>(msg));
     macPkt->encapsulate(static_cast<cPacket*>(msg));
@@ -361,30 +679,38 @@ void FTAMacLayer::handleUpperMsg(cMessage *msg) {
         delete msg;
         return;
     }
+    // the application may give the send time of its next packet
+    double nextSend = getNextSendTime(static_cast<cPacket*>(msg));
+    bool urgent = useUrgentStrobe && isUrgent(static_cast<cPacket*>(msg));
     addToQueue(msg);
-    if (lastData >= 0) {
+    if (useScheduleHint && nextSend > simTime().dbl()) {
+        newIwu = nextSend - simTime().dbl();
+        nextSendTime = nextSend;
+    } else if (lastData >= 0) {
         newIwu = simTime().dbl() - lastData;
     }
     lastData = simTime().dbl();
-    // force wakeup now
+    // an urgent packet wakes up its receiver now instead of waiting for the rendezvous
+    if (urgent && !strobing && (macState == SLEEP || macState == WAIT_WB) && startStrobes()) {
+        return;
+    }
+    // force wakeup now, or just before the rendezvous
     if (macState == SLEEP)
     {
-        if (wakeupDATA->isScheduled()) {
-            cancelEvent(wakeupDATA);
-        }
-        scheduleAt(simTime(), wakeupDATA);
+        scheduleDataWakeup();
     }
 
     // If this node is waiting for WB but is too long (need to send next data packet)
-    if (macState == WAIT_WB) {
+    // a deferred sender is already awake for the rendezvous, keep waiting
+    if (macState == WAIT_WB && !deferTransmission && !strobing) {
         if (rxWBTimeout->isScheduled()) {
             cancelEvent(rxWBTimeout);
         }
         macState = SLEEP;
 //        changeMACState();
         wbMiss++;
-        iwuVec[1].record((simTime().dbl() - startWake.dbl()) * 1000);
-        scheduleAt(simTime(), wakeupDATA);
+        iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+        scheduleDataWakeup();
     }
 }
 
@@ -416,6 +742,7 @@ void FTAMacLayer::changeMACState() {
         case CCA_WB:
         case WAIT_DATA:
         case CCA_ACK:
+        case SAMPLING:
             // change icon to green light -> note is wait for sign
             changeDisplayColor(GREEN);
             // set antenna to receiving sign state
@@ -424,6 +751,7 @@ void FTAMacLayer::changeMACState() {
         case SENDING_DATA:
         case SENDING_WB:
         case SENDING_ACK:
+        case SENDING_STROBE:
             changeDisplayColor(YELLOW);
             // set antenna to sending sign state
             phy->setRadioState(MiximRadio::TX);
@@ -454,11 +782,14 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
                 macState = WAIT_WB;
                 changeMACState();
                 // schedule the event wait WB timeout
-                scheduleAt(simTime() + waitWB, rxWBTimeout);
+                scheduleAt(simTime() + getWaitWB(), rxWBTimeout);
                 // store the moment that this node is wake up
                 startWake = simTime();
-                // reset number resend data
-                txAttempts = 0;
+                listenStart = simTime();
+                // slept until the rendezvous: the data is waiting since it arrived
+                if (deferTransmission && lastData >= 0) {
+                    startWake = lastData;
+                }
                 numberWakeup++;
                 if (simTime().dbl() > lastWakeup.dbl()) {
                     iwuVec[0].record((simTime().dbl() - lastWakeup.dbl())*1000);
@@ -471,39 +802,110 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
         case WAIT_WB:
             // If this message is event
             if (msg->getKind() == RX_WB_TIMEOUT) {
+                if (strobing) {
+                    // no WB yet: strobe again until the receiver had one sample
+                    if (simTime() < strobeEnd) {
+                        macState = SENDING_STROBE;
+                        changeMACState();
+                        return;
+                    }
+                    // the receiver did not answer, fall back on the rendezvous
+                    strobing = false;
+                    macState = SLEEP;
+                    changeMACState();
+                    iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+                    scheduleDataWakeup();
+                    return;
+                }
                 // Turn back to SLEEP state
                 macState = SLEEP;
                 changeMACState();
                 // Calculate the number WB missed
                 wbMiss++;
+                nbWBTimeouts++;
+                // the rendezvous may have moved: listen the whole waitWB next time
+                wbProbe = useAdaptiveWaitWB;
                 // log the time wait for WB
                 timeWaitWB = simTime().dbl() - startWake.dbl();
-                iwuVec[1].record(timeWaitWB * 1000);
+                iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
                 return;
             }
+            if (msg->getKind() == ACK && useAckChaining) {
+                macpktack_ptr_t ack = dynamic_cast<macpktack_ptr_t>(msg);
+                if (ack == NULL || ack->getNextAddr() != myMacAddr) {
+                    // the receiver serves another sender first
+                    if (ack != NULL && ack->getNextAddr() != LAddress::L2BROADCAST) {
+                        extendWaitWB();
+                    }
+                    delete msg;
+                    return;
+                }
+                // the ACK to the previous sender is the WB of this one
+                ack->setKind(WB);
+                ack->setDestAddr(myMacAddr);
+                nbChainedWB++;
+            }
             // duration the WAIT_WB, received the WB message -> change to CCA state & schedule the timeout event
             if (msg->getKind() == WB) {
                 macpkt_ptr_t            mac  = static_cast<macpkt_ptr_t>(msg);
                 const LAddress::L2Type& dest = mac->getDestAddr();
                 // Do nothing if receive WB for other node
                 if (dest != LAddress::L2BROADCAST && dest != myMacAddr) {
+                    if (useAckChaining && !strobing) {
+                        extendWaitWB();
+                    }
+                    if (!strobing) {
+                        handleOverheardWB(mac);
+                    }
                     mac = NULL;
                     // Drop this message
                     delete msg;
                     return;
                 }
+                if (useImplicitAck) {
+                    confirmImplicitAcks(msg);
+                }
+                // nothing queued for this receiver: keep waiting for the others
+                if (usePerDestQueues && !serveDestination(mac->getSrcAddr())) {
+                    mac = NULL;
+                    delete msg;
+                    return;
+                }
+                // a WB answering a STROBE is out of the receiver schedule
+                bool answeredStrobe = strobing;
+                strobing = false;
                 // log the time wait for WB
                 timeWaitWB = simTime().dbl() - startWake.dbl();
-                iwuVec[1].record(timeWaitWB * 1000);
+                iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+                if (!answeredStrobe) {
+                    updateWaitWB(simTime().dbl() - listenStart.dbl());
+                }
                 // Receiver is the node which send WB packet
                 receiverAddress = mac->getSrcAddr();
+                rendezvousStart = simTime();
+                if (!answeredStrobe) {
+                    lastWB = simTime().dbl();
+                    neighborWB[mac->getSrcAddr()].lastOwn = lastWB;
+                }
                 nbRxWB++;
+                // the queued packets may have expired while waiting for the WB
+                if (!dropExpiredPackets()) {
+                    cancelEvent(rxWBTimeout);
+                    macState = SLEEP;
+                    changeMACState();
+                    delete msg;
+                    return;
+                }
+                if (answeredStrobe) {
+                    serveUrgent(mac->getSrcAddr());
+                }
                 macState = CCA_DATA;
                 changeMACState();
                 // Don't need to call the event to handle WB timeout
                 cancelEvent (rxWBTimeout);
                 // schedule the CCA timeout event
-                scheduleAt(simTime() + waitCCA, ccaDATATimeout);
+                startBackoff(msg);
+                scheduleAt(simTime() + waitCCA + getBackoff(), ccaDATATimeout);
                 // reset ccaAttempts
                 ccaAttempts = 0;
                 mac = NULL;
@@ -516,6 +918,23 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
 
         case CCA_DATA:
             if (msg->getKind() == CCA_DATA_TIMEOUT) {
+                if (useBackoff && !phy->getChannelState().isIdle()) {
+                    nbCCAFailures++;
+                    ccaAttempts++;
+                    if (ccaAttempts < maxCCAattempts) {
+                        // busy channel: back off again over a doubled window
+                        if (backoffExponent < maxBE) {
+                            backoffExponent++;
+                        }
+                        scheduleAt(simTime() + waitCCA + getBackoff(), ccaDATATimeout);
+                    } else {
+                        // give up this rendezvous, the packets wait for the next one
+                        macState = SLEEP;
+                        changeMACState();
+                        scheduleDataWakeup();
+                    }
+                    return;
+                }
                 macState = SENDING_DATA;
                 changeMACState();
                 // change mac state to send data
@@ -526,13 +945,38 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
 
             break;
 
+        case SENDING_STROBE:
+            if (msg->getKind() == STROBE_SENT) {
+                // listen for the WB until the next STROBE
+                macState = WAIT_WB;
+                changeMACState();
+                scheduleAt(simTime() + strobeInterval, rxWBTimeout);
+                return;
+            }
+            break;
+
         case SENDING_DATA:
             // Finish send data to receiver
             if (msg->getKind() == DATA_SENT) {
+                // no ACK requested: the packets wait for the next WB of the receiver
+                if (implicitAckSent) {
+                    for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+                        awaitingAck.push_back(macQueue.front());
+                        macQueue.pop_front();
+                    }
+                    txAttempts = 0;
+                    macState = SLEEP;
+                    changeMACState();
+                    // the next WB also confirms the packets just sent
+                    if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                        scheduleDataWakeup();
+                    }
+                    return;
+                }
                 macState = WAIT_ACK;
                 changeMACState();
-                // schedule the event wait WB timeout
-                scheduleAt(simTime() + waitACK, waitACKTimeout);
+                // schedule the event wait WB timeout, a block ACK comes at the end of the DATA window
+                scheduleAt(simTime() + waitACK + (useBlockAck ? waitDATA : 0), waitACKTimeout);
 
                 return;
             }
@@ -543,33 +987,45 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
                 macState = SLEEP;
                 changeMACState();
                 nbMissedAcks++;
+                txAttempts++;
                 // if the number resend data is not reach max time
-//                if (txAttempts < maxTxAttempts) {
-//                    macState = WAIT_WB;
-//                    changeMACState();
-//                    txAttempts++;
-//
-//                    // schedule the event wait WB timeout
-//                    scheduleAt(simTime() + waitWB, rxWBTimeout);
-//                    // store the moment to wait WB
-//                    timeWaitWB = simTime();
-//                    nbMissedAcks++;
-//                } else {
-//                    macState = SLEEP;
-//                    changeMACState();
-//                    nbMissedAcks++;
-//                }
+                if (txAttempts < maxTxAttempts) {
+                    // resend the same packets at the next rendezvous
+                    nbRetransmissions++;
+                    scheduleDataWakeup();
+                } else {
+                    dropTxPackets();
+                    if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                        scheduleDataWakeup();
+                    }
+                }
                 return;
             }
             // received ACK -> change to sleep, schedule next wakeup time
             if (msg->getKind() == ACK) {
+                if (useBlockAck) {
+                    macpktack_ptr_t ack = dynamic_cast<macpktack_ptr_t>(msg);
+                    // the block ACK of another receiver
+                    if (ack == NULL || ack->getSrcAddr() != receiverAddress) {
+                        delete msg;
+                        return;
+                    }
+                    // our DATA was not received: handle it as a missed ACK now
+                    if (((ack->getBitmap() >> (nodeIdx - 1)) & 1) == 0) {
+                        nbBlockAckMiss++;
+                        cancelEvent(waitACKTimeout);
+                        scheduleAt(simTime(), waitACKTimeout);
+                        delete msg;
+                        return;
+                    }
+                }
                 //cout << "sender receipt ack -> sleep" << endl;
-                macState = SLEEP;
-                changeMACState();
                 //remove event wait ack timeout
                 cancelEvent(waitACKTimeout);
-                // Remove packet in queue
-                while (macQueue.size() > 0) {
+                txAttempts = 0;
+                // only the packets carried by the DATA are acknowledged
+                for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+                    recordClassDelay(macQueue.front());
                     delete macQueue.front();
                     macQueue.pop_front();
                 }
@@ -577,11 +1033,31 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
                 delete msg;
                 msg = NULL;
                 wbMiss = 0;
+                dropExpiredPackets();
+                // the receiver is still awake: send the next packet back to back
+                if (moreDataSent && macQueue.size() > 0) {
+                    macState = CCA_DATA;
+                    changeMACState();
+                    ccaAttempts = 0;
+                    scheduleAt(simTime() + waitCCA, ccaDATATimeout);
+                    return;
+                }
+                macState = SLEEP;
+                changeMACState();
+                if (macQueue.size() == 0) {
+                    drainVec.record((simTime() - rendezvousStart).dbl() * 1000);
+                }
+                // packets left in the queue are sent at the next rendezvous,
+                // the packets sent without ACK request wait for its WB
+                if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                    scheduleDataWakeup();
+                }
                 return;
             }
             break;
     }
-    if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK) {
+    if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK
+            || msg->getKind() == STROBE) {
         delete msg;
         msg = NULL;
         return;
@@ -595,6 +1071,17 @@ void FTAMacLayer::handleSelfMsgSender(cMessage *msg) {
  *
  */
 void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
+    // the channel samples run beside the wakeup schedule, only while sleeping
+    if (msg->getKind() == SAMPLE) {
+        scheduleAt(simTime() + sampleInterval, sampleTimer);
+        if (macState == SLEEP) {
+            macState = SAMPLING;
+            changeMACState();
+            scheduleAt(simTime() + sampleDuration, sampleTimeout);
+            nbSamples++;
+        }
+        return;
+    }
     switch (macState) {
         // Call at first time after initialize the note
         case INIT:
@@ -602,6 +1089,9 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 macState = SLEEP;
                 changeMACState();
                 scheduleNextWakeup();
+                if (useUrgentStrobe) {
+                    scheduleAt(simTime() + uniform(0, sampleInterval), sampleTimer);
+                }
                 return;
             }
             break;
@@ -615,8 +1105,57 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 // reset CCA attempts
                 ccaAttempts = 0;
                 scheduleAt(simTime() + waitCCA, ccaWBTimeout);
+                nbCCA++;
                 numberWakeup++;
-                writeLog();
+                if (!urgentWake) {
+                    writeLog();
+                }
+                return;
+            }
+            break;
+        // This node listens for a STROBE
+        case SAMPLING:
+            if (msg->getKind() == SAMPLE_TIMEOUT) {
+                macState = SLEEP;
+                changeMACState();
+                sampleTime += sampleDuration;
+                return;
+            }
+            if (msg->getKind() == WAKE_UP || msg->getKind() == STROBE) {
+                sampleTime += sampleDuration - (sampleTimeout->getArrivalTime() - simTime()).dbl();
+                cancelEvent(sampleTimeout);
+                macState = SLEEP;
+                if (msg->getKind() == WAKE_UP) {
+                    // the scheduled wakeup ends the sample
+                    handleSelfMsgReceiver(msg);
+                    return;
+                }
+                macpkt_ptr_t mac = static_cast<macpkt_ptr_t>(msg);
+                // the sender is known by the address of its last DATA
+                int nodeId = 0;
+                for (int i = 1; i <= numberSender; i++) {
+                    if (senderAddr[i] == mac->getSrcAddr()) {
+                        nodeId = i;
+                    }
+                }
+                if (mac->getDestAddr() == myMacAddr && nodeId > 0) {
+                    // answer with a WB now, the chosen senders keep their wakeup
+                    cancelEvent(wakeup);
+                    currentNode = nodeId;
+                    urgentWake = true;
+                    nbUrgentWakes++;
+                    scheduleAt(simTime(), wakeup);
+                } else {
+                    changeMACState();
+                }
+                delete msg;
+                msg = NULL;
+                mac = NULL;
+                return;
+            }
+            if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK) {
+                delete msg;
+                msg = NULL;
                 return;
             }
             break;
@@ -637,7 +1176,8 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 macState = WAIT_DATA;
                 changeMACState();
                 // Schedule wait data timeout event
-                scheduleAt(simTime() + waitDATA, rxDATATimeout);
+                scheduleAt(simTime() + getWaitDATA(), rxDATATimeout);
+                listenUntil = simTime() + waitDATA;
                 // Store the time sent WB - used to calculate the Iwu
                 globalSentWB = round(simTime().dbl() * 1000) / 1000;
                 return;
@@ -647,16 +1187,29 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
         case WAIT_DATA:
             // if wait data timeout -> go to sleep, calculate the next wakeup interval
             if (msg->getKind() == RX_DATA_TIMEOUT) {
+                // the chosen senders left are late: acknowledge the DATA received
+                if (ackCount > 0) {
+                    macState = CCA_ACK;
+                    changeMACState();
+                    ccaAttempts = 0;
+                    scheduleAt(simTime() + waitCCA, ccaACKTimeout);
+                    nbCCA++;
+                    return;
+                }
                 macState = SLEEP;
                 changeMACState();
+                recordListenSaved();
+                burstPending = false;
 
-                // calculate Iwu for the node that is chosen but didn't receive data
-                for (int i = 1; i <= numberSender; i++) {
+                // calculate Iwu for the node that is chosen but didn't receive data,
+                // an urgent wakeup keeps the schedule
+                for (int i = 1; i <= numberSender && !urgentWake; i++) {
                     if (nodeChosen[i] == 1) {
                         calculateNextInterval(i);
                         nodeChosen[i] = 0;
                     }
                 }
+                urgentWake = false;
                 // schedule for next wakeup time
                 scheduleNextWakeup();
 
@@ -664,12 +1217,22 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
             }
             // Receive data -> wait CCA to send ACK
             if (msg->getKind() == DATA) {
+                int nodeId = static_cast<macpktfta_ptr_t>(msg)->getNodeId();
+                bool ackRequested = static_cast<macpktfta_ptr_t>(msg)->getAckRequested();
                 // control the data packet
                 handleDataPacket(msg);
+                if (useBlockAck) {
+                    ackBitmap |= 1L << (nodeId - 1);
+                    ackCount++;
+                    // keep listening for the other chosen senders of this wakeup
+                    if (!urgentWake && hasChosenSender()) {
+                        return;
+                    }
+                }
                 // cancel event
                 cancelEvent(rxDATATimeout);
-                // if use ack
-                if (useMacAcks) {
+                // if use ack, the next WB confirms the DATA without ACK request
+                if (useMacAcks && ackRequested) {
                     //cout << "receiver have data, will send ack" << endl;
                     macState = CCA_ACK;
                     changeMACState();
@@ -677,11 +1240,15 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                     // reset cca attempt number
                     ccaAttempts = 0;
                     scheduleAt(simTime() + waitCCA, ccaACKTimeout);
+                    nbCCA++;
+                } else if (burstPending || (!urgentWake && hasChosenSender()) || !useEarlySleep) {
+                    // if no use ACK, wait for other DATA packet
+                    scheduleAt(simTime() + (burstPending ? waitDATA : getWaitDATA()), rxDATATimeout);
+                    listenUntil = simTime() + waitDATA;
+                } else {
+                    // every chosen sender is served
+                    scheduleAt(simTime(), rxDATATimeout);
                 }
-//                else {
-//                    // if no use ACK, wait for other DATA packet
-//                    scheduleAt(simTime() + waitDATA, rxDATATimeout);
-//                }
                 return;
             }
             break;
@@ -695,7 +1262,13 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
             }
             // if receive data -> Store DATA to queue
             if (msg->getKind() == DATA) {
+                int nodeId = static_cast<macpktfta_ptr_t>(msg)->getNodeId();
                 handleDataPacket(msg);
+                // still in time for the block ACK
+                if (useBlockAck) {
+                    ackBitmap |= 1L << (nodeId - 1);
+                    ackCount++;
+                }
                 // Radio is free to send ACK
 //                macState = SENDING_ACK;
 //                changeMACState();
@@ -714,15 +1287,35 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
 //                    scheduleAt(simTime() + waitDATA, rxDATATimeout);
 //                }
 
+                // the sender announced more data or the ACK named the next sender: stay awake for it
+                if (burstPending || chainPending) {
+                    chainPending = false;
+                    macState = WAIT_DATA;
+                    changeMACState();
+                    scheduleAt(simTime() + waitDATA, rxDATATimeout);
+                    listenUntil = simTime() + waitDATA;
+                    return;
+                }
+                // the other chosen senders may still come until they are declared lost
+                if (useEarlySleep && !urgentWake && hasChosenSender()) {
+                    macState = WAIT_DATA;
+                    changeMACState();
+                    scheduleAt(simTime() + getWaitDATA(), rxDATATimeout);
+                    listenUntil = simTime() + waitDATA;
+                    return;
+                }
                 macState = SLEEP;
                 changeMACState();
-                // calculate Iwu for the node that is chosen but didn't receive data
-                for (int i = 1; i <= numberSender; i++) {
+                recordListenSaved();
+                // calculate Iwu for the node that is chosen but didn't receive data,
+                // an urgent wakeup keeps the schedule
+                for (int i = 1; i <= numberSender && !urgentWake; i++) {
                     if (nodeChosen[i] == 1) {
                         calculateNextInterval(i);
                         nodeChosen[i] = 0;
                     }
                 }
+                urgentWake = false;
                 // schedule for next wakeup time
                 scheduleNextWakeup();
 
@@ -730,7 +1323,9 @@ void FTAMacLayer::handleSelfMsgReceiver(cMessage *msg) {
             }
             break;
     }
-    if (msg->getKind() == WB || msg->getKind() == DATA || msg->getKind() == ACK) {
+    // a STROBE heard while awake for other senders: its sender strobes again
+    if (msg->getKind() == WB || msg->getKind() == DATA || msg->getKind() == ACK
+            || msg->getKind() == STROBE) {
         delete msg;
         return;
     }
@@ -758,6 +1353,7 @@ void FTAMacLayer::handleSelfMsgTransmitter(cMessage *msg) {
                 // reset CCA attempts
                 ccaAttempts = 0;
                 scheduleAt(simTime() + waitCCA, ccaWBTimeout);
+                nbCCA++;
                 numberWakeup++;
                 writeLog();
                 return;
@@ -778,6 +1374,7 @@ void FTAMacLayer::handleSelfMsgTransmitter(cMessage *msg) {
                     if (ccaAttempts < 3) {
                         macState = CCA_WB;
                         scheduleAt(simTime() + waitCCA, ccaWBTimeout);
+                        nbCCA++;
                     } else {
                         // Turn back to SLEEP state
                         macState = SLEEP;
@@ -841,6 +1438,7 @@ void FTAMacLayer::handleSelfMsgTransmitter(cMessage *msg) {
                 ccaAttempts = 0;
                 changeMACState();
                 scheduleAt(simTime() + waitCCA, ccaACKTimeout);
+                nbCCA++;
                 return;
             }
             break;
@@ -855,6 +1453,7 @@ void FTAMacLayer::handleSelfMsgTransmitter(cMessage *msg) {
                     if (ccaAttempts < 3) {
                         macState = CCA_ACK;
                         scheduleAt(simTime() + waitCCA, ccaACKTimeout);
+                        nbCCA++;
                     } else {
                         // Turn back to SLEEP state
                         macState = SLEEP;
@@ -972,7 +1571,8 @@ void FTAMacLayer::handleSelfMsgTransmitter(cMessage *msg) {
             }
             break;
     }
-    if (msg->getKind() == WB || msg->getKind() == DATA || msg->getKind() == ACK) {
+    if (msg->getKind() == WB || msg->getKind() == DATA || msg->getKind() == ACK
+            || msg->getKind() == STROBE) {
         delete msg;
         return;
     }
@@ -993,88 +1593,636 @@ bool FTAMacLayer::handleDataPacket (cMessage *msg) {
         return false;
     }
 
-    // Calculate next wakeup interval
-    calculateNextInterval(nodeId, mac);
+    // Calculate next wakeup interval, only once per wakeup of a sender,
+    // the DATA of an urgent wakeup is out of the schedule
+    if (!urgentWake && (!burstPending || burstNode != nodeId)) {
+        calculateNextInterval(nodeId, mac);
+    }
+    burstPending = useFramePending && mac->getMoreData();
+    burstNode = nodeId;
+    senderAddr[nodeId] = mac->getSrcAddr();
     nbRxData[nodeId]++;
     nbRxDataPackets++;
     // Mark that this node already calculated & recevie DATA
-    nodeChosen[nodeId] = 0;
+    if (!urgentWake) {
+        nodeChosen[nodeId] = 0;
+    }
+    // copy the aggregated packets before the frame is queued or deleted
+    std::vector<macpktfta_ptr_t> packets;
+    for (unsigned int i = 0; i < mac->getPacketsArraySize(); i++) {
+        packets.push_back(mac->getPackets(i).dup());
+    }
+    nbRxDataPackets += packets.size();
+    mac->setPacketsArraySize(0);
+    // a retransmitted packet already received is only acknowledged
+    bool accepted = acceptSequence(nodeId, mac->getSequenceId());
     // If this data packet is not for this node -> push in queue to retransmit it
     if (dest != myMacAddr) {
-        macQueue.push_back(mac->dup());
+        if (accepted) {
+            // relayed packets are numbered again in the sequence of this node
+            macQueue.push_back(mac->dup());
+            macQueue.back()->setSequenceId(-1);
+        } else {
+            // a duplicate is only acknowledged: the ACK takes the front entry
+            macQueue.push_front(mac->dup());
+        }
+        for (unsigned int i = 0; i < packets.size(); i++) {
+            if (acceptSequence(nodeId, packets[i]->getSequenceId())) {
+                packets[i]->setSequenceId(-1);
+                macQueue.push_back(packets[i]);
+            } else {
+                delete packets[i];
+            }
+        }
+        delete mac;
         return true;
     } else {
+        // the next WB confirms a DATA without ACK request, no ACK to prepare;
+        // the transmitter FSM acknowledges every DATA
+        if (mac->getAckRequested() || role == NODE_TRANSMITER) {
+            macQueue.push_back(mac->dup());
+        } else {
+            ackPending[nodeId] = true;
+        }
         // send up the data packet
-        macQueue.push_back(mac->dup());
-        sendUp(decapsMsg(mac));
+        if (accepted) {
+            sendUp(decapsMsg(mac));
+        } else {
+            delete mac;
+        }
+        for (unsigned int i = 0; i < packets.size(); i++) {
+            if (acceptSequence(nodeId, packets[i]->getSequenceId())) {
+                sendUp(decapsMsg(packets[i]));
+            } else {
+                delete packets[i];
+            }
+        }
         return false;
     }
 }
 
-double FTAMacLayer::getCCA() {
-//    double tmp = 0.001;
-//    if (timeWaitWB < 3 * waitCCA) {
-//        tmp = waitCCA * (3 * waitCCA - timeWaitWB) / (3 * waitCCA);
-//    } else {
-//        tmp = (double)nodeIdx / 1000;
-//    }
-//    int idxTmp = (nodeIdx % 3);
-//    if (idxTmp == 0) {
-//        idxTmp = 3;
-//    }
-    double tmp = (double)(nodeIdx) / 1000;
-    return tmp;
+/**
+ * Traffic class of a packet, 0 if priority is not used.
+ */
+int FTAMacLayer::getPacketClass(cPacket *pkt) {
+    if (!usePriority) {
+        return 0;
+    }
+    int trafficClass = getTrafficClass(pkt);
+    if (trafficClass < 0) {
+        return 0;
+    }
+    return trafficClass < trafficClasses ? trafficClass : trafficClasses - 1;
 }
 
 /**
- * /!\ NOTE: This function is used only in recevier
- * Find next wakeup time
- * Change physic layer state
- * Change node color
- * Change state to SLEEP
+ * Priority-aware drop: a class over its own limit loses the new packet, a
+ * full queue evicts the newest packet of the least urgent class below it.
  */
-void FTAMacLayer::scheduleNextWakeup() {
-    simtime_t nextWakeup = 0;
-    simtime_t min = 100000;
-    // Find the nearest wakeup time
-    for (int i = 1; i <= numberSender; i++) {
-        // find out the closest wakeup moment
-        if (sourceNode[i] && nextWakeupTime[i] < min.dbl()) {
-            min = nextWakeupTime[i];
+bool FTAMacLayer::makeRoom(int trafficClass) {
+    int count = 0;
+    MacQueue::iterator victim = macQueue.end();
+    for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+        int packetClass = getPacketClass(*it);
+        if (packetClass == trafficClass) {
+            count++;
         }
+        // a packet already sent stays until it is acknowledged
+        if (packetClass > trafficClass && (*it)->getSequenceId() < 0
+                && (victim == macQueue.end() || packetClass >= getPacketClass(*victim))) {
+            victim = it;
+        }
+    }
+    if (count >= classQueueLength[trafficClass]) {
+        return false;
+    }
+    if (macQueue.size() < queueLength) {
+        return true;
+    }
+    if (victim == macQueue.end()) {
+        return false;
     }
+    dropQueuedPacket(victim, DroppedPacket::QUEUE);
+    return true;
+}
 
-    // find the nodes need to wakeup to receive data
+LAddress::L2Type FTAMacLayer::getNextChosenSender() {
     for (int i = 1; i <= numberSender; i++) {
-        if (sourceNode[i] && (nextWakeupTime[i] < min.dbl() + 3 * waitCCA || nextWakeupTime[i] < simTime().dbl())) {
-            if (nextWakeupTime[i] > nextWakeup.dbl()) {
-                nextWakeup = nextWakeupTime[i];
-            }
-            // mark that this node is chosen
-            nodeChosen[i] = 1;
+        if (nodeChosen[i] == 1 && senderAddr[i] != LAddress::L2BROADCAST) {
+            return senderAddr[i];
         }
     }
-    if (nextWakeup < simTime()) {
-        nextWakeup = simTime();
-    }
-    scheduleAt(nextWakeup, wakeup);
+    return LAddress::L2BROADCAST;
 }
 
-
-void FTAMacLayer::updateTSR(int nodeId, int value) {
+bool FTAMacLayer::hasUnknownChosenSender() {
+    for (int i = 1; i <= numberSender; i++) {
+        if (nodeChosen[i] == 1 && senderAddr[i] == LAddress::L2BROADCAST) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FTAMacLayer::extendWaitWB() {
+    simtime_t until = simTime() + waitCCA + waitDATA + waitACK;
+    if (rxWBTimeout->isScheduled() && rxWBTimeout->getArrivalTime() < until) {
+        cancelEvent(rxWBTimeout);
+        scheduleAt(until, rxWBTimeout);
+    }
+}
+
+bool FTAMacLayer::hasChosenSender() {
+    for (int i = 1; i <= numberSender; i++) {
+        if (nodeChosen[i] == 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * The packets for dest keep their order & go before the packets for the
+ * other receivers. The attempts of the packet set aside are kept until its
+ * receiver is served again.
+ */
+bool FTAMacLayer::serveDestination(const LAddress::L2Type& dest) {
+    if (macQueue.empty()) {
+        return false;
+    }
+    const LAddress::L2Type front = macQueue.front()->getDestAddr();
+    if (front == dest) {
+        return true;
+    }
+    MacQueue served;
+    MacQueue::iterator it = macQueue.begin();
+    while (it != macQueue.end()) {
+        MacQueue::iterator next = it;
+        ++next;
+        if ((*it)->getDestAddr() == dest) {
+            served.splice(served.end(), macQueue, it);
+        }
+        it = next;
+    }
+    if (served.empty()) {
+        return false;
+    }
+    macQueue.splice(macQueue.begin(), served);
+    destTxAttempts[front] = txAttempts;
+    txAttempts = destTxAttempts[dest];
+    destTxAttempts.erase(dest);
+    return true;
+}
+
+int FTAMacLayer::countDestPackets(const LAddress::L2Type& dest) {
+    int count = 0;
+    for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+        if ((*it)->getDestAddr() == dest) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Queue discipline applied before queueing a new packet: at most
+ * destQueueLength packets for one destination, and with dropOldest a full
+ * queue loses its oldest packet not sent yet instead of the new one. With
+ * priority the victim is the oldest packet of the least urgent class, never
+ * more urgent than the new one, and nothing is dropped for a new packet its
+ * class limit refuses anyway. Return false with the drop reason if the new
+ * packet has to be dropped.
+ */
+bool FTAMacLayer::applyQueueDiscipline(const LAddress::L2Type& dest, int trafficClass, int& reason) {
+    if (usePriority) {
+        int count = 0;
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if (getPacketClass(*it) == trafficClass) {
+                count++;
+            }
+        }
+        if (count >= classQueueLength[trafficClass]) {
+            return false;
+        }
+    }
+    if (destQueueLength > 0) {
+        int count = 0;
+        MacQueue::iterator oldest = macQueue.end();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if ((*it)->getDestAddr() == dest) {
+                count++;
+                if (isDropVictim(it, oldest, trafficClass)) {
+                    oldest = it;
+                }
+            }
+        }
+        if (count >= destQueueLength) {
+            if (!dropOldest || oldest == macQueue.end()) {
+                nbDestDropped++;
+                reason = DROP_DEST_LIMIT;
+                return false;
+            }
+            nbDestDropped++;
+            dropQueuedPacket(oldest, DROP_DEST_LIMIT);
+        }
+    }
+    if (dropOldest && macQueue.size() >= queueLength) {
+        MacQueue::iterator oldest = macQueue.end();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if (isDropVictim(it, oldest, trafficClass)) {
+                oldest = it;
+            }
+        }
+        if (oldest != macQueue.end()) {
+            nbDroppedOldest++;
+            dropQueuedPacket(oldest, DROP_OLDEST);
+        }
+    }
+    return true;
+}
+
+bool FTAMacLayer::isDropVictim(MacQueue::iterator it, MacQueue::iterator victim, int trafficClass) {
+    // a packet already sent stays until it is acknowledged
+    if ((*it)->getSequenceId() >= 0) {
+        return false;
+    }
+    // the queue is scanned from the oldest packet
+    if (!usePriority) {
+        return victim == macQueue.end();
+    }
+    int packetClass = getPacketClass(*it);
+    if (packetClass < trafficClass) {
+        return false;
+    }
+    return victim == macQueue.end() || packetClass > getPacketClass(*victim);
+}
+
+/**
+ * Drop the packets older than maxPacketAge before a DATA is sent, a packet
+ * already sent waits for its ACK or for retry exhaustion. Return true if
+ * there is still data to send.
+ */
+bool FTAMacLayer::dropExpiredPackets() {
+    if (maxPacketAge > 0) {
+        MacQueue::iterator it = macQueue.begin();
+        while (it != macQueue.end()) {
+            if ((*it)->getSequenceId() < 0 && simTime() - (*it)->getCreationTime() > maxPacketAge) {
+                nbExpired++;
+                it = dropQueuedPacket(it, DROP_EXPIRED);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return macQueue.size() > 0;
+}
+
+FTAMacLayer::MacQueue::iterator FTAMacLayer::dropQueuedPacket(MacQueue::iterator it, int reason) {
+    if (usePriority) {
+        nbClassDropped[getPacketClass(*it)]++;
+    }
+    droppedPacket.setReason(reason);
+    emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+    nbDroppedDataPackets++;
+    delete *it;
+    return macQueue.erase(it);
+}
+
+void FTAMacLayer::recordClassDelay(macpkt_ptr_t pkt) {
+    if (usePriority) {
+        classDelayVec[getPacketClass(pkt)].record((simTime() - pkt->getCreationTime()).dbl() * 1000);
+    }
+    if (useUrgentStrobe && isUrgent(pkt)) {
+        urgentDelayVec.record((simTime() - pkt->getCreationTime()).dbl() * 1000);
+    }
+}
+
+/**
+ * The contention window starts at 2^minBE slots, doubled for each doubling
+ * of the number of senders the receiver expects in its WB.
+ */
+void FTAMacLayer::startBackoff(cMessage *wb) {
+    backoffExponent = minBE;
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(wb);
+    int senders = (advert != NULL) ? advert->getExpectedSenders() : 1;
+    while ((1 << (backoffExponent - minBE)) < senders && backoffExponent < maxBE) {
+        backoffExponent++;
+    }
+}
+
+/**
+ * Random backoff before sensing the channel, 0 if backoff is not used.
+ */
+double FTAMacLayer::getBackoff() {
+    if (!useBackoff) {
+        return 0;
+    }
+    return intuniform(0, (1 << backoffExponent) - 1) * backoffSlot;
+}
+
+/**
+ * Duplicate filter: the sender numbers its packets in order and resends the
+ * oldest one until it is acknowledged or dropped, so a sequence number not
+ * above the last one accepted from this sender is a duplicate.
+ */
+bool FTAMacLayer::acceptSequence(int nodeId, long seq) {
+    if (seq <= lastSeq[nodeId]) {
+        nbDuplicates++;
+        return false;
+    }
+    lastSeq[nodeId] = seq;
+    return true;
+}
+
+/**
+ * Give up the packets carried by the last DATA after maxTxAttempts.
+ */
+void FTAMacLayer::dropTxPackets() {
+    // only the packets carried by the failed DATA
+    for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+        if (usePriority) {
+            nbClassDropped[getPacketClass(macQueue.front())]++;
+        }
+        delete macQueue.front();
+        macQueue.pop_front();
+        nbDroppedDataPackets++;
+    }
+    droppedPacket.setReason(DroppedPacket::RETRIES);
+    emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+    txAttempts = 0;
+}
+
+double FTAMacLayer::getCCA() {
+//    double tmp = 0.001;
+//    if (timeWaitWB < 3 * waitCCA) {
+//        tmp = waitCCA * (3 * waitCCA - timeWaitWB) / (3 * waitCCA);
+//    } else {
+//        tmp = (double)nodeIdx / 1000;
+//    }
+//    int idxTmp = (nodeIdx % 3);
+//    if (idxTmp == 0) {
+//        idxTmp = 3;
+//    }
+    double tmp = (double)(nodeIdx) / 1000;
+    return tmp;
+}
+
+/**
+ * /!\ NOTE: This function is used only in recevier
+ * Find next wakeup time
+ * Change physic layer state
+ * Change node color
+ * Change state to SLEEP
+ */
+void FTAMacLayer::scheduleNextWakeup() {
+    simtime_t nextWakeup = 0;
+    simtime_t min = 100000;
+    // Find the nearest wakeup time
+    for (int i = 1; i <= numberSender; i++) {
+        // find out the closest wakeup moment
+        if (sourceNode[i] && nextWakeupTime[i] < min.dbl()) {
+            min = nextWakeupTime[i];
+        }
+    }
+
+    // find the nodes need to wakeup to receive data
+    for (int i = 1; i <= numberSender; i++) {
+        if (sourceNode[i] && (nextWakeupTime[i] < min.dbl() + 3 * waitCCA || nextWakeupTime[i] < simTime().dbl())) {
+            if (nextWakeupTime[i] > nextWakeup.dbl()) {
+                nextWakeup = nextWakeupTime[i];
+            }
+            // mark that this node is chosen
+            nodeChosen[i] = 1;
+        }
+    }
+    if (nextWakeup < simTime()) {
+        nextWakeup = simTime();
+    }
+    scheduleAt(nextWakeup, wakeup);
+}
+
+
+void FTAMacLayer::updateTSR(int nodeId, int value) {
     for (int i = 0; i < TSR_length - 1; i++) {
         TSR_bank[nodeId][i] = TSR_bank[nodeId][i + 1];
     }
     TSR_bank[nodeId][TSR_length - 1] = value;
 }
 
+int FTAMacLayer::getTSRValue(int packetCount) {
+    if (!useWeightedTSR || packetCount < 1) {
+        return 1;
+    }
+    return packetCount < tsrLevels ? packetCount : tsrLevels;
+}
+
+double FTAMacLayer::getStep(int nodeId) {
+    if (useAdaptiveStep) {
+        return nodeStep[nodeId] * sysClock;
+    }
+    return sysClockFactor * sysClock;
+}
+
+/**
+ * AIMD on the step: additive increase after consecutive empty wakeups,
+ * multiplicative decrease when the prediction hits the data.
+ */
+void FTAMacLayer::updateStep(int nodeId, bool received) {
+    if (!useAdaptiveStep) {
+        return;
+    }
+    if (received) {
+        nodeMissRun[nodeId] = 0;
+        nodeStep[nodeId] *= stepDecrease;
+        if (nodeStep[nodeId] < stepMin) {
+            nodeStep[nodeId] = stepMin;
+        }
+    } else {
+        nodeMissRun[nodeId]++;
+        // a single miss may be jitter, grow only on consecutive misses
+        if (nodeMissRun[nodeId] > 1) {
+            nodeStep[nodeId] += stepIncrease;
+            if (nodeStep[nodeId] > stepMax) {
+                nodeStep[nodeId] = stepMax;
+            }
+        }
+    }
+    stepVec[nodeId].record(nodeStep[nodeId]);
+}
+
+/**
+ * Keep the last sloWindow MAC delays reported by a sender, estimate their p95
+ * and adapt the interval cap: shrink it when the target is missed, grow it by
+ * one step while it is binding and the p95 is comfortably under the target.
+ */
+void FTAMacLayer::updateLatencySLO(int nodeId, double delay) {
+    if (!useLatencySLO || nodeTargetDelay[nodeId] <= 0) {
+        return;
+    }
+    nodeDelay[nodeId][nodeDelayCount[nodeId] % sloWindow] = delay;
+    nodeDelayCount[nodeId]++;
+    if (nodeDelayCount[nodeId] < sloMinSamples) {
+        return;
+    }
+    int n = nodeDelayCount[nodeId] < sloWindow ? nodeDelayCount[nodeId] : sloWindow;
+    std::vector<double> samples(nodeDelay[nodeId], nodeDelay[nodeId] + n);
+    std::sort(samples.begin(), samples.end());
+    nodeP95[nodeId] = samples[int(ceil(0.95 * n)) - 1];
+    p95Vec[nodeId].record(nodeP95[nodeId] * 1000);
+
+    if (nodeP95[nodeId] > nodeTargetDelay[nodeId]) {
+        nodeSloCap[nodeId] *= 0.8;
+        if (nodeSloCap[nodeId] < sysClock) {
+            nodeSloCap[nodeId] = sysClock;
+        }
+    } else if (nodeP95[nodeId] < 0.8 * nodeTargetDelay[nodeId] && nodeSloCap[nodeId] <= nodeWakeupInterval[nodeId]) {
+        nodeSloCap[nodeId] += getStep(nodeId);
+    }
+}
+
+void FTAMacLayer::updateDormancy(int nodeId, bool received) {
+    if (!useDormancy) {
+        return;
+    }
+    // a dormant sender is resumed by boundInterval, after the estimator
+    if (received) {
+        nodeEmptyRun[nodeId] = 0;
+        return;
+    }
+    nodeEmptyRun[nodeId]++;
+    if (!nodeDormant[nodeId] && nodeEmptyRun[nodeId] >= dormantThreshold) {
+        nodeDormant[nodeId] = true;
+        nodeActiveInterval[nodeId] = nodeWakeupInterval[nodeId];
+        nodeDormantInterval[nodeId] = nodeWakeupInterval[nodeId];
+        nbDormant[nodeId]++;
+    }
+}
+
+/**
+ * Bootstrap of a newly seen sender: average its first bootstrapSamples non
+ * zero iwu and jump to the estimated period. The data carried by the current
+ * frame was generated at wbTime - idle, the next one is due one period later.
+ */
+bool FTAMacLayer::bootstrapInterval(int nodeId, double idle, double iwu, double wbTime) {
+    if (!useBootstrap || nodeBootDone[nodeId] || iwu <= 0) {
+        return false;
+    }
+    nodeBootSum[nodeId] += iwu;
+    nodeBootCount[nodeId]++;
+    if (nodeBootCount[nodeId] < bootstrapSamples) {
+        return false;
+    }
+    nodeBootDone[nodeId] = true;
+    double period = nodeBootSum[nodeId] / nodeBootCount[nodeId];
+    double next = wbTime - idle + period + sysClock;
+    while (next <= simTime().dbl()) {
+        next += period;
+    }
+    nodeWakeupIntervalLock[nodeId] = period;
+    nodeWakeupInterval[nodeId] = next - nextWakeupTime[nodeId];
+    markLocked(nodeId);
+    return true;
+}
+
+/**
+ * Schedule hint: the sender gives the exact time to its next packet & its
+ * period, the next wakeup is set just after that packet is generated.
+ */
+bool FTAMacLayer::scheduleHintInterval(int nodeId, double nextSend, double iwu) {
+    if (!useScheduleHint || nextSend < 0 || iwu <= 0) {
+        return false;
+    }
+    nodeWakeupIntervalLock[nodeId] = iwu;
+    nodeWakeupInterval[nodeId] = simTime().dbl() + nextSend + sysClock - nextWakeupTime[nodeId];
+    markLocked(nodeId);
+    return true;
+}
+
+void FTAMacLayer::markLocked(int nodeId) {
+    if (firstLockTime[nodeId] < 0) {
+        firstLockTime[nodeId] = simTime().dbl();
+    }
+}
+
+/**
+ * Track the age of information of a sender: the age just before this update
+ * is a peak, the freshest reading is taken from the creation time of the
+ * application packet carried by the frame.
+ */
+void FTAMacLayer::updateAoI(int nodeId, cPacket *pkt, double iwu) {
+    if (!useAoI) {
+        return;
+    }
+    if (iwu > 0) {
+        nodePeriod[nodeId] = iwu;
+    }
+    while (pkt->getEncapsulatedPacket() != NULL) {
+        pkt = pkt->getEncapsulatedPacket();
+    }
+    if (nodeLastGen[nodeId] >= 0) {
+        aoiVec[nodeId].record(simTime().dbl() - nodeLastGen[nodeId]);
+    }
+    if (pkt->getCreationTime().dbl() > nodeLastGen[nodeId]) {
+        nodeLastGen[nodeId] = pkt->getCreationTime().dbl();
+    }
+}
+
+void FTAMacLayer::boundInterval(int nodeId) {
+    // age of information: collect each reading before the next one within the energy budget
+    if (useAoI) {
+        if (nodePeriod[nodeId] > 0 && nodeWakeupInterval[nodeId] > nodePeriod[nodeId]) {
+            nodeWakeupInterval[nodeId] = nodePeriod[nodeId];
+        }
+        if (aoiMaxWakeRate > 0 && nodeWakeupInterval[nodeId] < 1 / aoiMaxWakeRate) {
+            nodeWakeupInterval[nodeId] = 1 / aoiMaxWakeRate;
+        }
+    }
+    if (useDormancy && nodeDormant[nodeId]) {
+        if (nodeEmptyRun[nodeId] == 0) {
+            // fast resume: never sleep longer than before the silence
+            nodeDormant[nodeId] = false;
+            if (nodeWakeupInterval[nodeId] > nodeActiveInterval[nodeId]) {
+                nodeWakeupInterval[nodeId] = nodeActiveInterval[nodeId];
+            }
+            nbDormantResume[nodeId]++;
+        } else {
+            // dormant sender: double the interval up to dormantMaxInterval, never shorten it
+            double backoff = 2 * std::max(nodeDormantInterval[nodeId], nodeWakeupInterval[nodeId]);
+            double cap = std::max(dormantMaxInterval, nodeActiveInterval[nodeId]);
+            if (backoff > cap) {
+                backoff = cap;
+            }
+            if (backoff > nodeWakeupInterval[nodeId]) {
+                nodeWakeupInterval[nodeId] = backoff;
+            }
+            nodeDormantInterval[nodeId] = nodeWakeupInterval[nodeId];
+        }
+    }
+    // latency SLO: never sleep longer than the cap of this sender
+    if (useLatencySLO && nodeTargetDelay[nodeId] > 0 && nodeWakeupInterval[nodeId] > nodeSloCap[nodeId]) {
+        nodeWakeupInterval[nodeId] = nodeSloCap[nodeId];
+    }
+}
+
 /**
  * Calculate next wakeup interval for current node
  */
 void FTAMacLayer::calculateNextInterval(int nodeId, macpktfta_ptr_t mac) {
     int n0 = 0;
     // Move the array TSR to left to store the new value in TSR[TSR_lenth - 1]
-    updateTSR(nodeId, (mac == NULL) ? 0 : 1);
+    updateTSR(nodeId, (mac == NULL) ? 0 : getTSRValue(mac->getPacketCount()));
+    updateStep(nodeId, mac != NULL);
+    updateDormancy(nodeId, mac != NULL);
+    if (mac != NULL) {
+        updateLatencySLO(nodeId, mac->getIdle() / 1000.0);
+        updateAoI(nodeId, mac, mac->getIwu() / 1000.0);
+        if (scheduleHintInterval(nodeId, mac->getNextSend() / 1000.0, mac->getIwu() / 1000.0)
+                || bootstrapInterval(nodeId, mac->getIdle() / 1000.0, mac->getIwu() / 1000.0, globalSentWB)) {
+            boundInterval(nodeId);
+            nextWakeupTime[nodeId] += nodeWakeupInterval[nodeId];
+            return;
+        }
+    }
 //    // Calculate n0;
     for (int i = 0; i < TSR_length; i++) {
         if (TSR_bank[nodeId][i] == 0) {
@@ -1095,10 +2243,27 @@ void FTAMacLayer::calculateNextInterval(int nodeId, macpktfta_ptr_t mac) {
             }
             double tmp = globalSentWB + round((iwu - idle) * 1000)/1000 + 0.0015;
             nodeWakeupInterval[nodeId] = tmp - nextWakeupTime[nodeId];
+            markLocked(nodeId);
         } else {
-            nodeWakeupInterval[nodeId] += sysClock * sysClockFactor;
+            nodeWakeupInterval[nodeId] += getStep(nodeId);
             nodeWakeupInterval[nodeId] = round(nodeWakeupInterval[nodeId] * 1000.0) / 1000.0;
         }
+        if (useWeightedTSR) {
+            // come back sooner while the sender reports more packets than one wakeup drains
+            int busy = 0;
+            double load = 0;
+            for (int i = 0; i < TSR_length; i++) {
+                if (TSR_bank[nodeId][i] > 0) {
+                    busy++;
+                    load += TSR_bank[nodeId][i];
+                }
+            }
+            load /= busy;
+            if (load > 1) {
+                nodeWakeupInterval[nodeId] = round(nodeWakeupInterval[nodeId] / load * 1000.0) / 1000.0;
+            }
+        }
+        boundInterval(nodeId);
         nextWakeupTime[nodeId] += nodeWakeupInterval[nodeId];
 //        std::cout << "time=" << simTime() << " | iwu=" << iwu << " | idle=" << idle << " | node iwu=" << nodeWakeupInterval[nodeId] << " | nextWakeupTime=" << nextWakeupTime[nodeId] << std::endl;
         return;
@@ -1139,8 +2304,9 @@ void FTAMacLayer::calculateNextInterval(int nodeId, macpktfta_ptr_t mac) {
         sentWB[nodeId] = globalSentWB;
     } else {
         // Did not receive the data
-        nodeWakeupInterval[nodeId] += sysClock * sysClockFactor;
+        nodeWakeupInterval[nodeId] += getStep(nodeId);
         nodeWakeupInterval[nodeId] = round(nodeWakeupInterval[nodeId] * 1000.0) / 1000.0;
+        boundInterval(nodeId);
         nextWakeupTime[nodeId] += nodeWakeupInterval[nodeId];
         return;
 
@@ -1192,6 +2358,9 @@ void FTAMacLayer::handleLowerControl(cMessage *msg) {
         if (macState == SENDING_ACK) {
             scheduleAt(simTime(), ACKsent);
         }
+        if (macState == SENDING_STROBE) {
+            scheduleAt(simTime(), strobeSent);
+        }
         packetError = false;
     }
     // Radio switching (to RX or TX) ir over, ignore switching to SLEEP.
@@ -1207,6 +2376,10 @@ void FTAMacLayer::handleLowerControl(cMessage *msg) {
                 && (phy->getRadioState() == MiximRadio::TX)) {
             sendMacAck();
         }
+        if ((macState == SENDING_STROBE)
+                && (phy->getRadioState() == MiximRadio::TX)) {
+            sendStrobe();
+        }
 //        // we were waiting for acks, but none came. we switched to TX and now
 //        // need to resend data
         if ((macState == SENDING_DATA)
@@ -1218,6 +2391,10 @@ void FTAMacLayer::handleLowerControl(cMessage *msg) {
         if (msg->getKind() == BaseDecider::PACKET_DROPPED) {
             packetError = true;
 //            nbPacketError++;
+            // a DATA lost while waiting for it: count it as a collision
+            if (macState == WAIT_DATA) {
+                nbCollision++;
+            }
         } else if (msg->getKind() == Decider802154Narrow::RECEPTION_STARTED) {
 
         } else {
@@ -1227,6 +2404,116 @@ void FTAMacLayer::handleLowerControl(cMessage *msg) {
     delete msg;
 }
 
+/**
+ * Frame control & FCS, the short addresses, then only the fields the frame
+ * carries: the node id is the short source address, the timing fields of
+ * the DATA are varints, one byte per sequence number & a varint length
+ * before each aggregated packet.
+ */
+long FTAMacLayer::getCompactLength(macpkt_ptr_t frame, long payload) {
+    int bytes = COMPACT_FRAME_SIZE + 2 * SHORT_ADDR_SIZE;
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(frame);
+    macpktack_ptr_t ack = dynamic_cast<macpktack_ptr_t>(frame);
+    macpktfta_ptr_t data = dynamic_cast<macpktfta_ptr_t>(frame);
+    if (advert != NULL) {
+        if (useBackoff) {
+            bytes += 1;
+        }
+        // short address & sequence number of each confirmed sender
+        bytes += advert->getAckSeqArraySize() * (SHORT_ADDR_SIZE + 1);
+    }
+    if (ack != NULL) {
+        if (useBlockAck) {
+            bytes += (numberSender + 7) / 8;
+        }
+        if (useAckChaining) {
+            bytes += SHORT_ADDR_SIZE;
+        }
+    }
+    if (data != NULL) {
+        // sequence number, idle, wbMiss & iwu
+        bytes += 1 + varintLength(data->getIdle()) + varintLength(data->getWbMiss()) + varintLength(data->getIwu());
+        // a relayed packet keeps the address of its source
+        if (data->getOriginalSrcAddr() != data->getSrcAddr()) {
+            bytes += FULL_ADDR_SIZE;
+        }
+        if (data->getNextSend() >= 0) {
+            bytes += varintLength(data->getNextSend());
+        }
+        for (unsigned int i = 0; i < data->getPacketsArraySize(); i++) {
+            long bits = useRealLength ? data->getPackets(i).getEncapsulatedPacket()->getBitLength() : dataLen * 8;
+            bytes += 1 + varintLength((bits + 7) / 8);
+            payload += bits;
+        }
+    }
+    return bytes * 8 + payload;
+}
+
+/**
+ * The WB carries the sequence number of the last DATA the receiver got from
+ * each sender it confirms. The packets sent to the receiver up to it are
+ * delivered, the later ones go back to the front of the queue, or are
+ * dropped once maxTxAttempts WBs did not confirm them.
+ */
+void FTAMacLayer::confirmImplicitAcks(cMessage *wb) {
+    macpkt_ptr_t mac = static_cast<macpkt_ptr_t>(wb);
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(wb);
+    long acked = -1;
+    if (advert != NULL) {
+        for (unsigned int i = 0; i < advert->getAckAddrArraySize(); i++) {
+            if (advert->getAckAddr(i) == myMacAddr) {
+                acked = advert->getAckSeq(i);
+            }
+        }
+    }
+    MacQueue lost;
+    MacQueue::iterator it = awaitingAck.begin();
+    while (it != awaitingAck.end()) {
+        if ((*it)->getDestAddr() != mac->getSrcAddr()) {
+            ++it;
+            continue;
+        }
+        long seq = (*it)->getSequenceId();
+        if (seq <= acked) {
+            nbImplicitAcks++;
+            recordClassDelay(*it);
+            implicitTxAttempts.erase(seq);
+            delete *it;
+        } else if (++implicitTxAttempts[seq] < maxTxAttempts) {
+            nbImplicitRetries++;
+            nbRetransmissions++;
+            lost.push_back(*it);
+        } else {
+            implicitTxAttempts.erase(seq);
+            if (usePriority) {
+                nbClassDropped[getPacketClass(*it)]++;
+            }
+            delete *it;
+            nbDroppedDataPackets++;
+            droppedPacket.setReason(DroppedPacket::RETRIES);
+            emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+        }
+        it = awaitingAck.erase(it);
+    }
+    macQueue.splice(macQueue.begin(), lost);
+}
+
+double FTAMacLayer::getWaitDATA() {
+    // the expected senders are declared lost after lostSenderTimeout
+    if (useEarlySleep && lostSenderTimeout > 0 && lostSenderTimeout < waitDATA) {
+        return lostSenderTimeout;
+    }
+    return waitDATA;
+}
+
+void FTAMacLayer::recordListenSaved() {
+    if (useEarlySleep) {
+        double saved = listenUntil > simTime() ? (listenUntil - simTime()).dbl() : 0;
+        listenSavedVec.record(saved * 1000);
+        listenSaved += saved;
+    }
+}
+
 /**
  * Send wakeup beacon from receiver to sender
  */
@@ -1234,13 +2521,53 @@ void FTAMacLayer::sendWB() {
     /**
      * For multi sender, the WB packet must send to exactly sender, cannot broadcast
      */
-    macpkt_ptr_t wb = new MacPkt();
+    macpkt_ptr_t wb;
+    macpktwb_ptr_t advert = NULL;
+    if (useBackoff || useImplicitAck) {
+        // tell the senders how many of them may answer this WB
+        advert = new MacPktWB();
+        int senders = 0;
+        for (int i = 1; i <= numberSender && !urgentWake; i++) {
+            senders += nodeChosen[i];
+        }
+        advert->setExpectedSenders(senders > 0 ? senders : 1);
+        wb = advert;
+    } else {
+        wb = new MacPkt();
+    }
     wb->setSrcAddr(myMacAddr);
-    wb->setDestAddr(LAddress::L2BROADCAST);
+    // with ACK chaining the first chosen sender is served alone, the others wait for their ACK.
+    // A sender never heard from can only be named by a broadcast WB
+    wb->setDestAddr(useAckChaining && !hasUnknownChosenSender() ? getNextChosenSender() : LAddress::L2BROADCAST);
+    // an urgent wakeup only answers the sender of the STROBE
+    if (urgentWake) {
+        wb->setDestAddr(senderAddr[currentNode]);
+    }
     wb->setName("WB");
     wb->setKind(WB);
     // WB have 7 bytes length
     wb->setBitLength(7 * 8);
+    if (useBackoff) {
+        // 1 byte for the number of expected senders
+        wb->addBitLength(8);
+    }
+    if (useImplicitAck) {
+        // confirm the DATA received since the last WB: 2 bytes of short address & 4 bytes of sequence number
+        for (int i = 1; i <= numberSender; i++) {
+            if (ackPending[i]) {
+                int n = advert->getAckAddrArraySize();
+                advert->setAckAddrArraySize(n + 1);
+                advert->setAckSeqArraySize(n + 1);
+                advert->setAckAddr(n, senderAddr[i]);
+                advert->setAckSeq(n, lastSeq[i]);
+                wb->addBitLength(48);
+                ackPending[i] = false;
+            }
+        }
+    }
+    if (useCompactHeaders) {
+        wb->setBitLength(getCompactLength(wb, 0));
+    }
 
     //attach signal and send down
     attachSignal(wb);
@@ -1252,7 +2579,47 @@ void FTAMacLayer::sendWB() {
  * Send one short preamble packet immediately.
  */
 void FTAMacLayer::sendMacAck() {
-    macpkt_ptr_t ack = new MacPkt();
+    if (useBlockAck) {
+        macpktack_ptr_t block = new MacPktACK();
+        block->setSrcAddr(myMacAddr);
+        block->setDestAddr(LAddress::L2BROADCAST);
+        block->setName("ACK");
+        block->setKind(ACK);
+        block->setBitmap(ackBitmap);
+        // ACK have 11 bytes length, plus one bit per sender
+        block->setBitLength(11 * 8 + (numberSender + 7) / 8 * 8);
+        if (useCompactHeaders) {
+            block->setBitLength(getCompactLength(block, 0));
+        }
+
+        //attach signal and send down
+        attachSignal(block);
+        sendDown(block);
+        nbTxAcks++;
+
+        // delete the packets of the acknowledged DATA in queue
+        for (int i = 0; i < ackCount && macQueue.size() > 0; i++) {
+            delete macQueue.front();
+            macQueue.pop_front();
+        }
+        ackBitmap = 0;
+        ackCount = 0;
+        return;
+    }
+    macpkt_ptr_t ack;
+    if (useAckChaining) {
+        // the next chosen sender takes this ACK as its WB
+        macpktack_ptr_t chained = new MacPktACK();
+        // the chosen senders of an urgent wakeup still sleep until their own
+        chained->setNextAddr(urgentWake ? LAddress::L2BROADCAST : getNextChosenSender());
+        chainPending = !burstPending && chained->getNextAddr() != LAddress::L2BROADCAST;
+        if (chainPending) {
+            nbChainedAcks++;
+        }
+        ack = chained;
+    } else {
+        ack = new MacPkt();
+    }
     ack->setSrcAddr(myMacAddr);
     //set dest addr is src addr of data packet
     ack->setDestAddr(macQueue.front()->getSrcAddr());
@@ -1260,6 +2627,13 @@ void FTAMacLayer::sendMacAck() {
     ack->setKind(ACK);
     // ACK have 11 bytes length
     ack->setBitLength(11 * 8);
+    if (useAckChaining) {
+        // 2 bytes for the short address of the next sender
+        ack->addBitLength(16);
+    }
+    if (useCompactHeaders) {
+        ack->setBitLength(getCompactLength(ack, 0));
+    }
 
     //attach signal and send down
     attachSignal(ack);
@@ -1274,26 +2648,302 @@ void FTAMacLayer::sendMacAck() {
 
 void FTAMacLayer::sendDataPacket() {
     nbTxDataPackets++;
+    // strict priority: the first packet of the most urgent class goes first,
+    // unless the front packet was already sent & waits for its ACK
+    if (usePriority && macQueue.front()->getSequenceId() < 0) {
+        MacQueue::iterator first = macQueue.begin();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            // the WB served one receiver, stay on its packets
+            if (usePerDestQueues && (*it)->getDestAddr() != (*first)->getDestAddr()) {
+                continue;
+            }
+            if (getPacketClass(*it) < getPacketClass(*first)) {
+                first = it;
+            }
+        }
+        macQueue.splice(macQueue.begin(), macQueue, first);
+    }
+    if (macQueue.front()->getSequenceId() < 0) {
+        macQueue.front()->setSequenceId(seqNum++);
+    }
     macpkt_ptr_t tmp = macQueue.front()->dup();
     macpktfta_ptr_t pkt = new MacPktFTA();
     pkt->setDestAddr(tmp->getDestAddr());
     pkt->setSrcAddr(tmp->getSrcAddr());
+    pkt->setSequenceId(tmp->getSequenceId());
+    // a relay keeps the ACKs for the packets it forwards
+    implicitAckSent = useImplicitAck && role == NODE_SENDER
+            && getPacketClass(macQueue.front()) >= implicitAckClass;
+    pkt->setAckRequested(!implicitAckSent);
     pkt->encapsulate(tmp->decapsulate());
 
     lastDataPktDestAddr = pkt->getDestAddr();
     pkt->setName("DATA");
     pkt->setKind(DATA);
     //DATA have 9 bytes of header, 2 bytes for checksum & data payload >= 2 bytes - default 13 bytes (total 24 bytes)
-    pkt->setByteLength(dataLen + 11);
+    if (useRealLength) {
+        pkt->setByteLength(pkt->getEncapsulatedPacket()->getByteLength() + 11);
+    } else {
+        pkt->setByteLength(dataLen + 11);
+    }
     pkt->setIdle(int(timeWaitWB * 1000));
     pkt->setWbMiss(wbMiss);
     pkt->setNodeId(nodeIdx);
     pkt->setIwu(int(newIwu * 1000));
+    // aggregate the next packets for the same destination while the airtime allows it
+    aggregated = 1;
+    if (maxAggregationAirtime > 0) {
+        MacQueue::iterator it = macQueue.begin();
+        for (++it; it != macQueue.end() && (*it)->getDestAddr() == pkt->getDestAddr(); ++it) {
+            // 2 bytes of sub header for each aggregated packet
+            double bits = ((useRealLength ? (*it)->getEncapsulatedPacket()->getByteLength() : dataLen) + 2) * 8;
+            if ((pkt->getBitLength() + bits) / bitrate > maxAggregationAirtime) {
+                break;
+            }
+            macpktfta_ptr_t sub = new MacPktFTA();
+            sub->setDestAddr((*it)->getDestAddr());
+            sub->setSrcAddr((*it)->getSrcAddr());
+            if ((*it)->getSequenceId() < 0) {
+                (*it)->setSequenceId(seqNum++);
+            }
+            sub->setSequenceId((*it)->getSequenceId());
+            sub->encapsulate((*it)->getEncapsulatedPacket()->dup());
+            pkt->setPacketsArraySize(aggregated);
+            pkt->setPackets(aggregated - 1, *sub);
+            pkt->addBitLength(long(bits));
+            delete sub;
+            aggregated++;
+        }
+    }
+    pkt->setNumberPacket(aggregated);
+    // with per destination queues only the packets for this receiver are pending
+    int pending = usePerDestQueues ? countDestPackets(pkt->getDestAddr()) : macQueue.size();
+    pkt->setPacketCount(pending);
+    // a DATA without ACK request ends the rendezvous
+    moreDataSent = useFramePending && pending > aggregated && !implicitAckSent;
+    if (useScheduleHint && nextSendTime > simTime().dbl()) {
+        pkt->setNextSend(long((nextSendTime - simTime().dbl()) * 1000));
+        pkt->addBitLength(16);
+    }
+    pkt->setMoreData(moreDataSent);
+    if (useCompactHeaders) {
+        pkt->setBitLength(getCompactLength(pkt, (useRealLength ? pkt->getEncapsulatedPacket()->getByteLength() : dataLen) * 8));
+    }
     attachSignal(pkt);
     sendDown(pkt);
     delete tmp;
 }
 
+/**
+ * Wake up just before the predicted rendezvous, or now if it is unknown or
+ * already passed. With deferred transmission the oldest packet in the queue
+ * is never held more than maxHoldTime.
+ */
+simtime_t FTAMacLayer::getDataWakeup() {
+    double now = simTime().dbl();
+    double wakeup = now;
+    if (deferTransmission) {
+        wakeup = predictRendezvous() - advertGuard;
+    }
+    if (deferTransmission && !macQueue.empty()) {
+        double deadline = macQueue.front()->getCreationTime().dbl() + maxHoldTime;
+        if (wakeup > deadline) {
+            wakeup = deadline;
+        }
+    }
+    return wakeup > now ? wakeup : now;
+}
+
+void FTAMacLayer::scheduleDataWakeup() {
+    if (wakeupDATA->isScheduled()) {
+        cancelEvent(wakeupDATA);
+    }
+    scheduleAt(getDataWakeup(), wakeupDATA);
+}
+
+/**
+ * Listening time before giving up the WB: a high quantile of the last waits
+ * for the receiver of the first packet in the queue plus a margin, never
+ * more than waitWB.
+ */
+double FTAMacLayer::getWaitWB() {
+    double timeout = waitWB;
+    if (useAdaptiveWaitWB && !wbProbe && !macQueue.empty()) {
+        timeout = getDestWaitWB(macQueue.front()->getDestAddr());
+        // listen until the latest WB expected from the receivers with packets
+        if (usePerDestQueues) {
+            for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+                double destTimeout = getDestWaitWB((*it)->getDestAddr());
+                if (destTimeout > timeout) {
+                    timeout = destTimeout;
+                }
+            }
+        }
+    }
+    wbTimeoutVec.record(timeout * 1000);
+    return timeout;
+}
+
+double FTAMacLayer::getDestWaitWB(const LAddress::L2Type& dest) {
+    double timeout = waitWB;
+    std::list<double>& waits = wbWaits[dest];
+    if (int(waits.size()) >= wbWaitMinSamples) {
+        std::vector<double> samples(waits.begin(), waits.end());
+        std::sort(samples.begin(), samples.end());
+        double quantile = samples[int(ceil(waitWBQuantile * samples.size())) - 1];
+        if (quantile + waitWBMargin < timeout) {
+            timeout = quantile + waitWBMargin;
+        }
+    }
+    return timeout;
+}
+
+void FTAMacLayer::updateWaitWB(double wait) {
+    wbProbe = false;
+    if (!useAdaptiveWaitWB || macQueue.empty()) {
+        return;
+    }
+    std::list<double>& waits = wbWaits[macQueue.front()->getDestAddr()];
+    waits.push_back(wait);
+    if (int(waits.size()) > wbWaitWindow) {
+        waits.pop_front();
+    }
+}
+
+bool FTAMacLayer::isUrgent(cPacket *pkt) {
+    return usePriority && getPacketClass(pkt) <= urgentClass;
+}
+
+/**
+ * Like X-MAC, the sender of an urgent packet repeats short STROBEs to its
+ * receiver, listening for the WB between two of them. The train lasts one
+ * sampleInterval plus one sample so that a sleeping receiver samples it once.
+ */
+bool FTAMacLayer::startStrobes() {
+    MacQueue::iterator it = macQueue.begin();
+    while (it != macQueue.end() && !isUrgent(*it)) {
+        it++;
+    }
+    // the urgent packet was not queued
+    if (it == macQueue.end()) {
+        return false;
+    }
+    strobeDest = (*it)->getDestAddr();
+    if (wakeupDATA->isScheduled()) {
+        cancelEvent(wakeupDATA);
+    }
+    if (macState == WAIT_WB) {
+        cancelEvent(rxWBTimeout);
+    } else {
+        startWake = simTime();
+        listenStart = simTime();
+        numberWakeup++;
+    }
+    strobing = true;
+    strobeEnd = simTime() + sampleInterval + sampleDuration;
+    macState = SENDING_STROBE;
+    changeMACState();
+    return true;
+}
+
+void FTAMacLayer::sendStrobe() {
+    macpkt_ptr_t strobe = new MacPkt();
+    strobe->setSrcAddr(myMacAddr);
+    strobe->setDestAddr(strobeDest);
+    strobe->setName("STROBE");
+    strobe->setKind(STROBE);
+    // STROBE have 7 bytes length like the WB
+    strobe->setBitLength(7 * 8);
+    if (useCompactHeaders) {
+        strobe->setBitLength(getCompactLength(strobe, 0));
+    }
+
+    //attach signal and send down
+    attachSignal(strobe);
+    sendDown(strobe);
+    nbStrobes++;
+}
+
+/**
+ * The WB obtained by a strobe train goes to the urgent packet as soon as the
+ * packets waiting for a retry are sent: they keep their sequence number &
+ * attempts, so the receiver never sees a packet numbered again and the
+ * sequence numbers reach it in order.
+ */
+void FTAMacLayer::serveUrgent(const LAddress::L2Type& dest) {
+    MacQueue::iterator first = macQueue.begin();
+    while (first != macQueue.end() && (*first)->getSequenceId() >= 0) {
+        first++;
+    }
+    MacQueue::iterator it = first;
+    while (it != macQueue.end() && (!isUrgent(*it) || (*it)->getDestAddr() != dest)) {
+        it++;
+    }
+    // already sent, or expired
+    if (it == macQueue.end()) {
+        return;
+    }
+    macQueue.splice(first, macQueue, it);
+}
+
+/**
+ * A WB overheard from a receiver to another sender: the receiver is awake &
+ * busy with that sender for about waitDATA + waitACK. If our own rendezvous
+ * with it, predicted from our last WB & data interval, falls after the end
+ * of the listen window, this wake cannot succeed: sleep until just before
+ * that rendezvous. If it is already due, keep listening until the receiver
+ * is free again.
+ */
+void FTAMacLayer::handleOverheardWB(macpkt_ptr_t wb) {
+    nbOverheardWB++;
+    double now = simTime().dbl();
+    NeighborWB& neighbor = neighborWB[wb->getSrcAddr()];
+    neighbor.lastHeard = now;
+    neighbor.busyUntil = now + waitDATA + waitACK;
+    if (!useOverheardWB || macQueue.empty() || wb->getSrcAddr() != macQueue.front()->getDestAddr()) {
+        return;
+    }
+    // packets for other receivers: their WB may still come in this window
+    if (usePerDestQueues && countDestPackets(wb->getSrcAddr()) < int(macQueue.size())) {
+        return;
+    }
+    double next = -1;
+    if (neighbor.lastOwn >= 0 && newIwu > 0) {
+        next = neighbor.lastOwn + ceil((now - neighbor.lastOwn) / newIwu) * newIwu;
+    }
+    double deadline = rxWBTimeout->getArrivalTime().dbl();
+    if (next < 0 || next <= neighbor.busyUntil) {
+        // our turn comes once the receiver is done with the other sender
+        if (deadline < neighbor.busyUntil + waitCCA) {
+            cancelEvent(rxWBTimeout);
+            scheduleAt(neighbor.busyUntil + waitCCA, rxWBTimeout);
+        }
+    } else if (next - advertGuard > deadline) {
+        nbSkippedListen++;
+        cancelEvent(rxWBTimeout);
+        macState = SLEEP;
+        changeMACState();
+        iwuVec[1].record((now - listenStart.dbl()) * 1000);
+        if (wakeupDATA->isScheduled()) {
+            cancelEvent(wakeupDATA);
+        }
+        scheduleAt(next - advertGuard, wakeupDATA);
+    }
+}
+
+/**
+ * Next WB from the receiver: the advertised one if known, else the last WB
+ * shifted by a whole number of data intervals, the receiver being locked on
+ * the traffic of this node.
+ */
+double FTAMacLayer::predictRendezvous() {
+    double now = simTime().dbl();
+    if (deferTransmission && lastWB >= 0 && newIwu > 0) {
+        return lastWB + ceil((now - lastWB) / newIwu) * newIwu;
+    }
+    return now;
+}
+
 void FTAMacLayer::attachSignal(macpkt_ptr_t macPkt) {
     //calc signal duration
     simtime_t duration = macPkt->getBitLength() / bitrate;
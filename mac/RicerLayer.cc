@@ -46,6 +46,10 @@ void RicerLayer::initialize(int stage) {
         role = static_cast<ROLES>(hasPar("role") ? par("role") : 1);
 
         queueLength = hasPar("queueLength") ? par("queueLength") : 10;
+        dropOldest = hasPar("queueDiscipline") && par("queueDiscipline").stdstringValue() == "dropOldest";
+        maxPacketAge = hasPar("maxPacketAge") ? par("maxPacketAge") : 0;
+        destQueueLength = hasPar("destQueueLength") ? par("destQueueLength") : 0;
+        useRealLength = hasPar("useRealLength") ? par("useRealLength") : false;
         animation = hasPar("animation") ? par("animation") : true;
         bitrate = hasPar("bitrate") ? par("bitrate") : 250000;
         iwu = hasPar("iwu") ? par("iwu") : 0.05;
@@ -72,6 +76,9 @@ void RicerLayer::initialize(int stage) {
         nbTxAcks = 0;
         nbTxRelayData = 0;
         nbPacketError = 0;
+        nbExpired = 0;
+        nbDroppedOldest = 0;
+        nbDestDropped = 0;
         idleVec.setName("idle");
 
         txAttempts = 0;
@@ -163,6 +170,9 @@ void RicerLayer::finish() {
         recordScalar("nbTxAcks", nbTxAcks);
         recordScalar("nbDroppedDataPackets", nbDroppedDataPackets);
         recordScalar("nbPacketError", nbPacketError);
+        recordScalar("nbExpired", nbExpired);
+        recordScalar("nbDroppedOldest", nbDroppedOldest);
+        recordScalar("nbDestDropped", nbDestDropped);
     }
 }
 
@@ -293,6 +303,8 @@ void RicerLayer::handleSelfMsg(cMessage *msg) {
                 return;
             }
             nbRxBeacons++;
+            // the queued packets may have expired while waiting for the beacon
+            dropExpiredPackets();
             if (macQueue.size() > 0) {
                 MacPkt *pkt = macQueue.front()->dup();
                 lastDataPktDestAddr = pkt->getDestAddr();
@@ -519,11 +531,17 @@ void RicerLayer::sendDataPacket() {
         pkt->setDestAddr(forwardAddr);
         int nbPkt = macQueue.size();
         pkt->setPacketsArraySize(nbPkt);
+        if (useRealLength) {
+            pkt->setBitLength(headerLength);
+        }
         int idx = 0;
         // Aggregate all packets in queue & send to destination
         while (macQueue.front()) {
             dataPkt_prt_t tmp = macQueue.front()->dup();
             pkt->setPackets(idx, *tmp);
+            if (useRealLength) {
+                pkt->addBitLength(tmp->getBitLength());
+            }
             // remove data packet in queue
             delete macQueue.front();
             macQueue.pop_front();
@@ -589,13 +607,15 @@ void RicerLayer::handleLowerControl(cMessage *msg) {
  * needed header fields.
  */
 bool RicerLayer::addToQueue(cMessage *msg) {
-    if (macQueue.size() >= queueLength) {
+    int reason = DroppedPacket::QUEUE;
+    if (!applyQueueDiscipline(getUpperDestinationFromControlInfo(msg->getControlInfo()), reason)
+            || macQueue.size() >= queueLength) {
         // queue is full, message has to be deleted
         debugEV << "New packet arrived, but queue is FULL, so new packet is deleted\n";
         msg->setName("MAC ERROR");
         msg->setKind(PACKET_DROPPED);
         sendControlUp(msg);
-        droppedPacket.setReason(DroppedPacket::QUEUE);
+        droppedPacket.setReason(reason);
         emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
         nbDroppedDataPackets++;
         return false;
@@ -622,6 +642,80 @@ bool RicerLayer::addToQueue(cMessage *msg) {
     return true;
 }
 
+/**
+ * Queue discipline applied before queueing a new packet: at most
+ * destQueueLength packets for one destination, and with dropOldest a full
+ * queue loses its oldest packet instead of the new one. Return false with
+ * the drop reason if the new packet has to be dropped.
+ */
+bool RicerLayer::applyQueueDiscipline(const LAddress::L2Type& dest, int& reason) {
+    if (destQueueLength > 0) {
+        int count = 0;
+        MacQueue::iterator oldest = macQueue.end();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if ((*it)->getDestAddr() == dest) {
+                count++;
+                if (oldest == macQueue.end() && !isInFlight(it)) {
+                    oldest = it;
+                }
+            }
+        }
+        if (count >= destQueueLength) {
+            if (!dropOldest || oldest == macQueue.end()) {
+                nbDestDropped++;
+                reason = DROP_DEST_LIMIT;
+                return false;
+            }
+            nbDestDropped++;
+            dropQueuedPacket(oldest, DROP_DEST_LIMIT);
+        }
+    }
+    if (dropOldest && macQueue.size() >= queueLength) {
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if (!isInFlight(it)) {
+                nbDroppedOldest++;
+                dropQueuedPacket(it, DROP_OLDEST);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * The first packet of the queue is in flight from the beacon until its ACK.
+ */
+bool RicerLayer::isInFlight(MacQueue::iterator it) {
+    return it == macQueue.begin()
+            && (macState == SEND_DATA || macState == WAIT_TX_DATA_OVER || macState == WAIT_ACK);
+}
+
+/**
+ * Drop the packets older than maxPacketAge before a DATA is sent.
+ */
+void RicerLayer::dropExpiredPackets() {
+    if (maxPacketAge <= 0) {
+        return;
+    }
+    MacQueue::iterator it = macQueue.begin();
+    while (it != macQueue.end()) {
+        if (simTime() - (*it)->getCreationTime() > maxPacketAge) {
+            nbExpired++;
+            it = dropQueuedPacket(it, DROP_EXPIRED);
+        } else {
+            ++it;
+        }
+    }
+}
+
+RicerLayer::MacQueue::iterator RicerLayer::dropQueuedPacket(MacQueue::iterator it, int reason) {
+    droppedPacket.setReason(reason);
+    emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+    nbDroppedDataPackets++;
+    delete *it;
+    return macQueue.erase(it);
+}
+
 void RicerLayer::attachSignal(MacPkt *macPkt) {
     //calc signal duration
 
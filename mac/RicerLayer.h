@@ -203,6 +203,18 @@ class MIXIM_API RicerLayer : public BaseMacLayer
     int nicId;
     /** @brief The maximum length of the queue */
     double queueLength;
+    /**
+     * Queue discipline: dropOldest keeps the newest packets when the queue is
+     * full, packets older than maxPacketAge are dropped when a beacon comes
+     * (0 = never) & one destination holds at most destQueueLength packets
+     * (0 = no limit).
+     */
+    bool dropOldest;
+    double maxPacketAge;
+    int destQueueLength;
+    long nbExpired;
+    long nbDroppedOldest;
+    long nbDestDropped;
     /** @brief Animate (colorize) the nodes.
      *
      * The color of the node reflects its basic status (not the exact state!)
@@ -217,6 +229,8 @@ class MIXIM_API RicerLayer : public BaseMacLayer
     double bitrate;
     /** @brief The length of the MAC header */
     double headerLength;
+    /** @brief Real length: a relayed DATA is as long as the packets it carries */
+    bool useRealLength;
     /** @brief The duration of CCA */
     double checkInterval;
     double iwu;
@@ -266,6 +280,18 @@ class MIXIM_API RicerLayer : public BaseMacLayer
 
     /** @brief Internal function to add a new packet from upper to the queue */
     bool addToQueue(cMessage * msg);
+
+    /** @brief Apply the queue discipline before queueing a packet for dest */
+    bool applyQueueDiscipline(const LAddress::L2Type& dest, int& reason);
+
+    /** @brief Return true if the packet is being sent */
+    bool isInFlight(MacQueue::iterator it);
+
+    /** @brief Drop the expired packets */
+    void dropExpiredPackets();
+
+    /** @brief Drop one queued packet for the given reason */
+    MacQueue::iterator dropQueuedPacket(MacQueue::iterator it, int reason);
 };
 
 #endif /* RicerLAYER_H_ */
@@ -33,6 +33,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <MacPkt_m.h>
+#include <algorithm>
+#include "tool.h"
+#include "BaseDecider.h"
 
 Define_Module(TADMacLayer)
 
@@ -60,15 +63,117 @@ void TADMacLayer::initialize(int stage) {
         TSR_length = hasPar("tsrLength") ? par("tsrLength") : 8;
         numberSender = hasPar("numberSender") ? par("numberSender") : 1;
 
+        useAdaptiveStep = hasPar("useAdaptiveStep") ? par("useAdaptiveStep") : false;
+        stepIncrease = hasPar("stepIncrease") ? par("stepIncrease") : 5;
+        stepDecrease = hasPar("stepDecrease") ? par("stepDecrease") : 0.5;
+        stepMin = hasPar("stepMin") ? par("stepMin") : 1;
+        stepMax = hasPar("stepMax") ? par("stepMax") : 500;
+        useWeightedTSR = hasPar("useWeightedTSR") ? par("useWeightedTSR") : false;
+        tsrLevels = hasPar("tsrLevels") ? par("tsrLevels") : 4;
+        useLatencySLO = hasPar("useLatencySLO") ? par("useLatencySLO") : false;
+        useBootstrap = hasPar("useBootstrap") ? par("useBootstrap") : false;
+        bootstrapSamples = hasPar("bootstrapSamples") ? par("bootstrapSamples") : 2;
+        useAoI = hasPar("useAoI") ? par("useAoI") : false;
+        aoiMaxWakeRate = hasPar("aoiMaxWakeRate") ? par("aoiMaxWakeRate") : 0;
+        useDormancy = hasPar("useDormancy") ? par("useDormancy") : false;
+        dormantThreshold = hasPar("dormantThreshold") ? par("dormantThreshold") : 8;
+        dormantMaxInterval = hasPar("dormantMaxInterval") ? par("dormantMaxInterval") : 1;
+
+        useScheduleAdvert = hasPar("useScheduleAdvert") ? par("useScheduleAdvert") : false;
+        advertGuard = hasPar("advertGuard") ? par("advertGuard") : 0.005;
+        deferTransmission = hasPar("deferTransmission") ? par("deferTransmission") : false;
+        maxHoldTime = hasPar("maxHoldTime") ? par("maxHoldTime") : 1;
+
+        useFramePending = hasPar("useFramePending") ? par("useFramePending") : false;
+        maxAggregationAirtime = hasPar("maxAggregationAirtime") ? par("maxAggregationAirtime") : 0;
+        useAdaptiveWaitWB = hasPar("useAdaptiveWaitWB") ? par("useAdaptiveWaitWB") : false;
+        waitWBQuantile = hasPar("waitWBQuantile") ? par("waitWBQuantile") : 0.95;
+        waitWBMargin = hasPar("waitWBMargin") ? par("waitWBMargin") : 0.005;
+        wbProbe = false;
+        nbWBTimeouts = 0;
+        aggregated = 1;
+        burstPending = false;
+        moreDataSent = false;
         queueLength = hasPar("queueLength") ? par("queueLength") : 8;
+        useCompactHeaders = hasPar("useCompactHeaders") ? par("useCompactHeaders") : false;
+        useImplicitAck = hasPar("useImplicitAck") ? par("useImplicitAck") : false;
+        implicitAckClass = hasPar("implicitAckClass") ? par("implicitAckClass") : 0;
+        implicitAckSent = false;
+        nbImplicitAcks = 0;
+        nbImplicitRetries = 0;
+        useEarlySleep = hasPar("useEarlySleep") ? par("useEarlySleep") : false;
+        lostSenderTimeout = hasPar("lostSenderTimeout") ? par("lostSenderTimeout") : 0;
+        listenSaved = 0;
+        listenSavedVec.setName("listenSaved");
+        useRealLength = hasPar("useRealLength") ? par("useRealLength") : false;
+        maxFramePayload = hasPar("maxFramePayload") ? par("maxFramePayload") : 0;
+        txFragment = 0;
+        nbTxFragments = 0;
+        nbReassembled = 0;
+        usePerDestQueues = hasPar("usePerDestQueues") ? par("usePerDestQueues") : false;
+        useUrgentStrobe = hasPar("useUrgentStrobe") ? par("useUrgentStrobe") : false;
+        urgentClass = hasPar("urgentClass") ? par("urgentClass") : 0;
+        sampleInterval = hasPar("sampleInterval") ? par("sampleInterval") : 0.1;
+        sampleDuration = hasPar("sampleDuration") ? par("sampleDuration") : 0.004;
+        strobeInterval = hasPar("strobeInterval") ? par("strobeInterval") : 0.003;
+        strobing = false;
+        urgentWake = false;
+        nbStrobes = 0;
+        nbUrgentWakes = 0;
+        nbSamples = 0;
+        sampleTime = 0;
+        urgentDelayVec.setName("urgentDelay");
+        useOverheardWB = hasPar("useOverheardWB") ? par("useOverheardWB") : false;
+        nbOverheardWB = 0;
+        nbSkippedListen = 0;
+        useBackoff = hasPar("useBackoff") ? par("useBackoff") : false;
+        backoffSlot = hasPar("backoffSlot") ? par("backoffSlot") : 0.00032;
+        minBE = hasPar("minBE") ? par("minBE") : 2;
+        maxBE = hasPar("maxBE") ? par("maxBE") : 5;
+        maxCCAattempts = hasPar("maxCCAattempts") ? par("maxCCAattempts") : 2;
+        backoffExponent = minBE;
+        nbCCAFailures = 0;
+        nbCollision = 0;
+        useScheduleHint = hasPar("useScheduleHint") ? par("useScheduleHint") : false;
+        nextSendTime = -1;
+        dropOldest = hasPar("queueDiscipline") && par("queueDiscipline").stdstringValue() == "dropOldest";
+        maxPacketAge = hasPar("maxPacketAge") ? par("maxPacketAge") : 0;
+        destQueueLength = hasPar("destQueueLength") ? par("destQueueLength") : 0;
+        nbExpired = 0;
+        nbDroppedOldest = 0;
+        nbDestDropped = 0;
+        usePriority = hasPar("usePriority") ? par("usePriority") : false;
+        trafficClasses = hasPar("trafficClasses") ? par("trafficClasses") : 2;
+        classQueueLength = new int[trafficClasses];
+        nbClassDropped = new long[trafficClasses];
+        classDelayVec = new cOutVector[trafficClasses];
+        for (int i = 0; i < trafficClasses; i++) {
+            classQueueLength[i] = queueLength;
+            nbClassDropped[i] = 0;
+
+            ostringstream converter;
+            converter << "classDelay_" << i;
+            classDelayVec[i].setName(converter.str().c_str());
+        }
+        if (hasPar("classQueueLengths")) {
+            std::vector<int> lengths = split(par("classQueueLengths").stdstringValue(), ',');
+            for (int i = 0; i < trafficClasses && i < int(lengths.size()); i++) {
+                classQueueLength[i] = lengths[i];
+            }
+        }
         animation = hasPar("animation") ? par("animation") : true;
         bitrate = hasPar("bitrate") ? par("bitrate") : 250000.;
         headerLength = hasPar("headerLength") ? par("headerLength") : 10.;
         txPower = hasPar("txPower") ? par("txPower") : 50.;
         useMacAcks = hasPar("useMACAcks") ? par("useMACAcks") : false;
-        maxTxAttempts = hasPar("maxTxAttempts") ? par("maxTxAttempts") : 2;
+        // the first transmission plus macMaxFrameRetries retransmissions
+        maxTxAttempts = (hasPar("macMaxFrameRetries") ? (int) par("macMaxFrameRetries") : 1) + 1;
 
         waitCCA = headerLength / bitrate;
+        // a sample must hear at least one STROBE of the train
+        if (sampleDuration < strobeInterval + waitCCA) {
+            sampleDuration = strobeInterval + waitCCA;
+        }
 
         stats = par("stats");
         nbTxDataPackets = 0;
@@ -82,6 +187,9 @@ void TADMacLayer::initialize(int stage) {
         numWUConvergent = 0;
 
         txAttempts = 0;
+        seqNum = 0;
+        nbRetransmissions = 0;
+        nbDuplicates = 0;
         lastDataPktDestAddr = LAddress::L2BROADCAST;
         lastDataPktSrcAddr = LAddress::L2BROADCAST;
 
@@ -121,6 +229,12 @@ void TADMacLayer::initialize(int stage) {
             ACKsent = new cMessage("ACK_SENT");
             ACKsent->setKind(ACK_SENT);
 
+            sampleTimer = new cMessage("SAMPLE");
+            sampleTimer->setKind(SAMPLE);
+
+            sampleTimeout = new cMessage("SAMPLE_TIMEOUT");
+            sampleTimeout->setKind(SAMPLE_TIMEOUT);
+
             int nodeIdx = getNode()->getIndex();
             // allocate memory & initialize for TSR bank
             TSR_bank = new int*[numberSender+1];
@@ -178,6 +292,96 @@ void TADMacLayer::initialize(int stage) {
                 converter << "Iwu_" << (i + nodeIdx);
                 iwuVec[i].setName(converter.str().c_str());
             }
+
+            // the adaptive step starts from the fixed step
+            nodeStep = new double[numberSender+1];
+            nodeMissRun = new int[numberSender+1];
+            stepVec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeStep[i] = sysClockFactor;
+                nodeMissRun[i] = 0;
+
+                ostringstream converter;
+                converter << "step_" << (i + nodeIdx);
+                stepVec[i].setName(converter.str().c_str());
+            }
+
+            // per sender latency target, targetDelays (ms) overrides targetDelay
+            double targetDelay = hasPar("targetDelay") ? par("targetDelay") : 0.1;
+            std::vector<int> targets = split(hasPar("targetDelays") ? par("targetDelays") : "", ',');
+            nodeTargetDelay = new double[numberSender+1];
+            nodeSloCap = new double[numberSender+1];
+            nodeDelay = new double*[numberSender+1];
+            nodeDelayCount = new int[numberSender+1];
+            nodeP95 = new double[numberSender+1];
+            p95Vec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeTargetDelay[i] = targetDelay;
+                if (i <= int(targets.size()) && targets[i - 1] > 0) {
+                    nodeTargetDelay[i] = targets[i - 1] / 1000.0;
+                }
+                // with uniform arrivals the p95 delay is 95% of the interval
+                nodeSloCap[i] = nodeTargetDelay[i] / 0.95;
+                nodeDelay[i] = new double[sloWindow];
+                nodeDelayCount[i] = 0;
+                nodeP95[i] = 0;
+
+                ostringstream converter;
+                converter << "p95_" << (i + nodeIdx);
+                p95Vec[i].setName(converter.str().c_str());
+            }
+
+            nodeEmptyRun = new int[numberSender+1];
+            nodeDormant = new bool[numberSender+1];
+            nodeActiveInterval = new double[numberSender+1];
+            nodeDormantInterval = new double[numberSender+1];
+            nbDormant = new long[numberSender+1];
+            nbDormantResume = new long[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeEmptyRun[i] = 0;
+                nodeDormant[i] = false;
+                nodeActiveInterval[i] = 0;
+                nodeDormantInterval[i] = 0;
+                nbDormant[i] = 0;
+                nbDormantResume[i] = 0;
+            }
+
+            nodeBootCount = new int[numberSender+1];
+            nodeBootSum = new double[numberSender+1];
+            nodeBootDone = new bool[numberSender+1];
+            firstLockTime = new double[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodeBootCount[i] = 0;
+                nodeBootSum[i] = 0;
+                nodeBootDone[i] = false;
+                firstLockTime[i] = -1;
+            }
+
+            nodePeriod = new double[numberSender+1];
+            nodeLastGen = new double[numberSender+1];
+            aoiVec = new cOutVector[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                nodePeriod[i] = 0;
+                nodeLastGen[i] = -1;
+
+                ostringstream converter;
+                converter << "aoi_" << (i + nodeIdx);
+                aoiVec[i].setName(converter.str().c_str());
+            }
+
+            lastSeq = new long[numberSender+1];
+            shortConfirmed = new bool[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                lastSeq[i] = -1;
+                shortConfirmed[i] = false;
+            }
+
+            fragSeq = new long[numberSender+1];
+            fragNext = new int[numberSender+1];
+            for (int i = 1; i <= numberSender; i++) {
+                fragSeq[i] = -1;
+                fragNext[i] = 0;
+            }
         } else {
             /**
              * Initialization of events for sender
@@ -203,12 +407,19 @@ void TADMacLayer::initialize(int stage) {
             waitACKTimeout = new cMessage("WAIT_ACK_TIMEOUT");
             waitACKTimeout->setKind(WAIT_ACK_TIMEOUT);
 
+            strobeSent = new cMessage("STROBE_SENT");
+            strobeSent->setKind(STROBE_SENT);
+
             iwuVec = new cOutVector[2];
             iwuVec[0].setName("Iwu");
             iwuVec[1].setName("idle");
+            drainVec.setName("drainTime");
+            wbTimeoutVec.setName("wbTimeout");
 
             lastData = -1;
             newIwu = 0;
+            nextRendezvous = -1;
+            lastWB = -1;
 
 //            ACKreceived = new cMessage("ACK_RECEIVED");
 //            ACKreceived->setKind(ACK_RECEIVED);
@@ -230,6 +441,8 @@ TADMacLayer::~TADMacLayer() {
         cancelAndDelete(DATAreceived);
         cancelAndDelete(ccaACKTimeout);
         cancelAndDelete(ACKsent);
+        cancelAndDelete(sampleTimer);
+        cancelAndDelete(sampleTimeout);
     } else {
         cancelAndDelete(start);
         cancelAndDelete(wakeupDATA);
@@ -239,6 +452,7 @@ TADMacLayer::~TADMacLayer() {
         cancelAndDelete(DATAsent);
         cancelAndDelete(waitACKTimeout);
         cancelAndDelete(ACKreceived);
+        cancelAndDelete(strobeSent);
     }
 
     MacQueue::iterator it;
@@ -246,6 +460,10 @@ TADMacLayer::~TADMacLayer() {
         delete (*it);
     }
     macQueue.clear();
+    for (it = awaitingAck.begin(); it != awaitingAck.end(); ++it) {
+        delete (*it);
+    }
+    awaitingAck.clear();
 }
 
 void TADMacLayer::finish() {
@@ -260,6 +478,51 @@ void TADMacLayer::finish() {
         recordScalar("nbMissedAcks", nbMissedAcks);
         recordScalar("nbRecvdAcks", nbRecvdAcks);
         recordScalar("nbTxAcks", nbTxAcks);
+        recordScalar("nbRetransmissions", nbRetransmissions);
+        recordScalar("nbDuplicates", nbDuplicates);
+        recordScalar("nbDroppedDataPackets", nbDroppedDataPackets);
+        recordScalar("nbExpired", nbExpired);
+        recordScalar("nbCCAFailures", nbCCAFailures);
+        if (useImplicitAck && role == NODE_SENDER) {
+            recordScalar("nbImplicitAcks", nbImplicitAcks);
+            recordScalar("nbImplicitRetries", nbImplicitRetries);
+        }
+        if (useEarlySleep && role != NODE_SENDER) {
+            recordScalar("listenSaved", listenSaved, "s");
+        }
+        if (useRealLength && maxFramePayload > 0) {
+            if (role == NODE_SENDER) {
+                recordScalar("nbTxFragments", nbTxFragments);
+            } else {
+                recordScalar("nbReassembled", nbReassembled);
+            }
+        }
+        if (useUrgentStrobe) {
+            if (role == NODE_SENDER) {
+                recordScalar("nbStrobes", nbStrobes);
+            } else {
+                recordScalar("nbUrgentWakes", nbUrgentWakes);
+                recordScalar("nbSamples", nbSamples);
+                recordScalar("sampleTime", sampleTime, "s");
+            }
+        }
+        if (role == NODE_SENDER) {
+            recordScalar("nbOverheardWB", nbOverheardWB);
+            recordScalar("nbSkippedListen", nbSkippedListen);
+        }
+        recordScalar("nbCollision", nbCollision);
+        recordScalar("nbDroppedOldest", nbDroppedOldest);
+        recordScalar("nbDestDropped", nbDestDropped);
+        if (role == NODE_SENDER) {
+            recordScalar("nbWBTimeouts", nbWBTimeouts);
+            if (usePriority) {
+                for (int i = 0; i < trafficClasses; i++) {
+                    ostringstream converter;
+                    converter << "nbClassDropped_" << i;
+                    recordScalar(converter.str().c_str(), nbClassDropped[i]);
+                }
+            }
+        }
         recordScalar("numberWakeup", numberWakeup);
         recordScalar("error_radio", (numberWakeup - nbRxWB) / double(numberWakeup * 1.0) * 100.0);
         if (role == NODE_RECEIVER) {
@@ -269,6 +532,31 @@ void TADMacLayer::finish() {
                 recordScalar(converter.str().c_str(), nbRxData[i]);
             }
             recordScalar("numWUConvergent", numWUConvergent);
+            for (int i = 1; i <= numberSender; i++) {
+                ostringstream converter;
+                converter << "firstLockTime_" << i;
+                recordScalar(converter.str().c_str(), firstLockTime[i], "s");
+            }
+            if (useLatencySLO) {
+                for (int i = 1; i <= numberSender; i++) {
+                    ostringstream converter;
+                    converter << "p95Delay_" << i;
+                    recordScalar(converter.str().c_str(), nodeP95[i], "s");
+                    converter.str("");
+                    converter << "targetDelay_" << i;
+                    recordScalar(converter.str().c_str(), nodeTargetDelay[i], "s");
+                }
+            }
+            if (useDormancy) {
+                for (int i = 1; i <= numberSender; i++) {
+                    ostringstream converter;
+                    converter << "nbDormant_" << i;
+                    recordScalar(converter.str().c_str(), nbDormant[i]);
+                    converter.str("");
+                    converter << "nbDormantResume_" << i;
+                    recordScalar(converter.str().c_str(), nbDormantResume[i]);
+                }
+            }
         }
     }
 }
@@ -282,16 +570,22 @@ cObject* TADMacLayer::setUpControlInfo(cMessage * const pMsg, const LAddress::L2
 }
 
 bool TADMacLayer::addToQueue(cMessage * msg) {
-    if (macQueue.size() >= queueLength) {
+    int trafficClass = getPacketClass(static_cast<cPacket*>(msg));
+    int reason = DroppedPacket::QUEUE;
+    if (!applyQueueDiscipline(getUpperDestinationFromControlInfo(msg->getControlInfo()), trafficClass, reason)
+            || (usePriority ? !makeRoom(trafficClass) : macQueue.size() >= queueLength)) {
         // queue is full, message has to be deleted
         debugEV << simTime() << ":New packet arrived, but queue is FULL, so new packet is"
                   " deleted\n";
         msg->setName("MAC ERROR");
         msg->setKind(PACKET_DROPPED);
         sendControlUp(msg);
-        droppedPacket.setReason(DroppedPacket::QUEUE);
+        droppedPacket.setReason(reason);
         emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
         nbDroppedDataPackets++;
+        if (usePriority) {
+            nbClassDropped[trafficClass]++;
+        }
 
         return false;
     }
@@ -305,6 +599,8 @@ bool TADMacLayer::addToQueue(cMessage * msg) {
     macPkt->setDestAddr(getUpperDestinationFromControlInfo(cInfo));
     delete cInfo;
     macPkt->setSrcAddr(myMacAddr);
+    // numbered when it is sent the first time
+    macPkt->setSequenceId(-1);
 
     assert(static_cast<cPacket*>(msg));
     macPkt->encapsulate(static_cast<cPacket*>(msg));
@@ -326,28 +622,38 @@ void TADMacLayer::handleUpperMsg(cMessage *msg) {
 //    bool pktAdded = addToQueue(msg);
 //    if (!pktAdded)
 //        return;
+    // the application may give the send time of its next packet
+    double nextSend = getNextSendTime(static_cast<cPacket*>(msg));
+    bool urgent = useUrgentStrobe && isUrgent(static_cast<cPacket*>(msg));
     addToQueue(msg);
-    if (lastData >= 0) {
+    if (useScheduleHint && nextSend > simTime().dbl()) {
+        newIwu = nextSend - simTime().dbl();
+        nextSendTime = nextSend;
+    } else if (lastData >= 0) {
         newIwu = simTime().dbl() - lastData;
     }
     lastData = simTime().dbl();
-    // force wakeup now
+    // an urgent packet wakes up its receiver now instead of waiting for the rendezvous
+    if (urgent && !strobing && (macState == SLEEP || macState == WAIT_WB) && startStrobes()) {
+        return;
+    }
+    // force wakeup now, or just before the rendezvous
     if (macState == SLEEP) {
-        if (wakeupDATA->isScheduled()) {
-            cancelEvent(wakeupDATA);
-        }
-        scheduleAt(simTime(), wakeupDATA);
+        scheduleDataWakeup();
     }
 
     // If this node is waiting for WB but is too long (need to send next data packet)
-    if (macState == WAIT_WB) {
+    // a deferred sender is already awake for the rendezvous, keep waiting
+    if (macState == WAIT_WB && !deferTransmission && !strobing) {
         if (rxWBTimeout->isScheduled()) {
             cancelEvent(rxWBTimeout);
         }
         macState = SLEEP;
-//        changeMACState();
-        iwuVec[1].record((simTime().dbl() - startWake.dbl()) * 1000);
-        scheduleAt(simTime(), wakeupDATA);
+        iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+        if (getDataWakeup() > simTime()) {
+            changeMACState();
+        }
+        scheduleDataWakeup();
     }
 }
 
@@ -395,6 +701,7 @@ void TADMacLayer::changeMACState() {
         case CCA_WB:
         case WAIT_DATA:
         case CCA_ACK:
+        case SAMPLING:
             // change icon to green light -> note is wait for sign
             changeDisplayColor(GREEN);
             // set antenna to receiving sign state
@@ -405,6 +712,7 @@ void TADMacLayer::changeMACState() {
         case SENDING_DATA:
         case SENDING_WB:
         case SENDING_ACK:
+        case SENDING_STROBE:
             changeDisplayColor(YELLOW);
             // set antenna to sending sign state
             if (phy->getRadioState() != MiximRadio::TX) {
@@ -435,11 +743,14 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
                 macState = WAIT_WB;
                 changeMACState();
                 // schedule the event wait WB timeout
-                scheduleAt(simTime() + waitWB, rxWBTimeout);
+                scheduleAt(simTime() + getWaitWB(), rxWBTimeout);
                 // store the moment that this node is wake up
                 startWake = simTime();
-                // reset number resend data
-                txAttempts = 0;
+                listenStart = simTime();
+                // slept until the rendezvous: the data is waiting since it arrived
+                if ((useScheduleAdvert || deferTransmission) && lastData >= 0) {
+                    startWake = lastData;
+                }
                 numberWakeup++;
                 iwuVec[0].record((simTime().dbl() - lastWakeup.dbl()) * 1000);
                 lastWakeup = simTime();
@@ -450,10 +761,28 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
         case WAIT_WB:
             // If this message is event
             if (msg->getKind() == RX_WB_TIMEOUT) {
+                if (strobing) {
+                    // no WB yet: strobe again until the receiver had one sample
+                    if (simTime() < strobeEnd) {
+                        macState = SENDING_STROBE;
+                        changeMACState();
+                        return;
+                    }
+                    // the receiver did not answer, fall back on the rendezvous
+                    strobing = false;
+                    macState = SLEEP;
+                    changeMACState();
+                    iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+                    scheduleDataWakeup();
+                    return;
+                }
                 // Turn back to SLEEP state
                 macState = SLEEP;
                 changeMACState();
-                iwuVec[1].record((simTime().dbl() - startWake.dbl()) * 1000);
+                nbWBTimeouts++;
+                // the rendezvous may have moved: listen the whole waitWB next time
+                wbProbe = useAdaptiveWaitWB;
+                iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
                 return;
             }
             // duration the WAIT_WB, received the WB message -> change to CCA state & schedule the timeout event
@@ -462,23 +791,64 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
                 const LAddress::L2Type& dest = mac->getDestAddr();
                 // Do nothing if receive WB for other node
                 if (dest != myMacAddr) {
+                    if (!strobing) {
+                        handleOverheardWB(mac);
+                    }
                     mac = NULL;
                     // Drop this message
                     delete msg;
                     return;
                 }
+                if (useImplicitAck) {
+                    confirmImplicitAcks(msg);
+                }
+                // association: the receiver gives us a short address
+                macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(msg);
+                if (useCompactHeaders && advert != NULL && advert->getShortAddr() > 0) {
+                    shortAddr[mac->getSrcAddr()] = advert->getShortAddr();
+                }
+                // nothing queued for this receiver: keep waiting for the others
+                if (usePerDestQueues && !serveDestination(mac->getSrcAddr())) {
+                    mac = NULL;
+                    delete msg;
+                    return;
+                }
                 // Receiver is the node which send WB packet
                 receiverAddress = mac->getSrcAddr();
+                rendezvousStart = simTime();
+                updateRendezvous(msg);
+                // a WB answering a STROBE is out of the receiver schedule
+                bool answeredStrobe = strobing;
+                strobing = false;
+                if (!answeredStrobe) {
+                    lastWB = simTime().dbl();
+                    neighborWB[mac->getSrcAddr()].lastOwn = lastWB;
+                }
                 nbRxWB++;
+                // the queued packets may have expired while waiting for the WB
+                if (!dropExpiredPackets()) {
+                    cancelEvent(rxWBTimeout);
+                    macState = SLEEP;
+                    changeMACState();
+                    delete msg;
+                    return;
+                }
+                if (answeredStrobe) {
+                    serveUrgent(mac->getSrcAddr());
+                }
                 macState = CCA_DATA;
                 changeMACState();
                 // Don't need to call the event to handle WB timeout
                 cancelEvent (rxWBTimeout);
                 // schedule the CCA timeout event
-                scheduleAt(simTime() + waitCCA, ccaDATATimeout);
+                startBackoff(msg);
+                scheduleAt(simTime() + waitCCA + getBackoff(), ccaDATATimeout);
                 // log the time wait for WB
                 timeWaitWB = simTime() - startWake;
-                iwuVec[1].record((timeWaitWB.dbl()) * 1000);
+                iwuVec[1].record((simTime().dbl() - listenStart.dbl()) * 1000);
+                if (!answeredStrobe) {
+                    updateWaitWB(simTime().dbl() - listenStart.dbl());
+                }
                 // reset ccaAttempts
                 ccaAttempts = 0;
                 mac = NULL;
@@ -491,6 +861,23 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
 
         case CCA_DATA:
             if (msg->getKind() == CCA_DATA_TIMEOUT) {
+                if (useBackoff && !phy->getChannelState().isIdle()) {
+                    nbCCAFailures++;
+                    ccaAttempts++;
+                    if (ccaAttempts < maxCCAattempts) {
+                        // busy channel: back off again over a doubled window
+                        if (backoffExponent < maxBE) {
+                            backoffExponent++;
+                        }
+                        scheduleAt(simTime() + waitCCA + getBackoff(), ccaDATATimeout);
+                    } else {
+                        // give up this rendezvous, the packets wait for the next one
+                        macState = SLEEP;
+                        changeMACState();
+                        scheduleDataWakeup();
+                    }
+                    return;
+                }
                 macState = SENDING_DATA;
                 changeMACState();
                 // change mac state to send data
@@ -500,9 +887,34 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
             }
             break;
 
+        case SENDING_STROBE:
+            if (msg->getKind() == STROBE_SENT) {
+                // listen for the WB until the next STROBE
+                macState = WAIT_WB;
+                changeMACState();
+                scheduleAt(simTime() + strobeInterval, rxWBTimeout);
+                return;
+            }
+            break;
+
         case SENDING_DATA:
             // Finish send data to receiver
             if (msg->getKind() == DATA_SENT) {
+                // no ACK requested: the packets wait for the next WB of the receiver
+                if (implicitAckSent) {
+                    for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+                        awaitingAck.push_back(macQueue.front());
+                        macQueue.pop_front();
+                    }
+                    txAttempts = 0;
+                    macState = SLEEP;
+                    changeMACState();
+                    // the next WB also confirms the packets just sent
+                    if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                        scheduleDataWakeup();
+                    }
+                    return;
+                }
                 macState = WAIT_ACK;
                 changeMACState();
                 // schedule the event wait WB timeout
@@ -516,38 +928,66 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
                 macState = SLEEP;
                 changeMACState();
                 nbMissedAcks++;
+                txAttempts++;
                 // if the number resend data is not reach max time
-//                if (txAttempts < maxTxAttempts) {
-//                    macState = WAIT_WB;
-//                    changeMACState();
-//                    txAttempts++;
-//
-//                    // schedule the event wait WB timeout
-//                    scheduleAt(simTime() + waitWB, rxWBTimeout);
-//                    // store the moment to wait WB
-//                    timeWaitWB = simTime();
-//                    nbMissedAcks++;
-//                } else {
-//                    macState = SLEEP;
-//                    changeMACState();
-//                    nbMissedAcks++;
-//                }
+                if (txAttempts < maxTxAttempts) {
+                    // resend the same packets at the next rendezvous
+                    nbRetransmissions++;
+                    scheduleDataWakeup();
+                } else {
+                    dropTxPackets();
+                    if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                        scheduleDataWakeup();
+                    }
+                }
                 return;
             }
             // received ACK -> change to sleep, schedule next wakeup time
             if (msg->getKind() == ACK) {
-                macState = SLEEP;
-                changeMACState();
                 //remove event wait ack timeout
                 cancelEvent(waitACKTimeout);
-                // Remove packet in queue
-                while (macQueue.size() > 0) {
+                updateRendezvous(msg);
+                txAttempts = 0;
+                // the next fragment of the packet goes back to back
+                if (txFragment < getFragmentCount(macQueue.front()) - 1) {
+                    txFragment++;
+                    delete msg;
+                    msg = NULL;
+                    macState = CCA_DATA;
+                    changeMACState();
+                    ccaAttempts = 0;
+                    scheduleAt(simTime() + waitCCA, ccaDATATimeout);
+                    return;
+                }
+                txFragment = 0;
+                // only the packets carried by the DATA are acknowledged
+                for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+                    recordClassDelay(macQueue.front());
                     delete macQueue.front();
                     macQueue.pop_front();
                 }
                 //Delete ACK
                 delete msg;
                 msg = NULL;
+                dropExpiredPackets();
+                // the receiver is still awake: send the next packet back to back
+                if (moreDataSent && macQueue.size() > 0) {
+                    macState = CCA_DATA;
+                    changeMACState();
+                    ccaAttempts = 0;
+                    scheduleAt(simTime() + waitCCA, ccaDATATimeout);
+                    return;
+                }
+                macState = SLEEP;
+                changeMACState();
+                if (macQueue.size() == 0) {
+                    drainVec.record((simTime() - rendezvousStart).dbl() * 1000);
+                }
+                // packets left in the queue are sent at the next rendezvous,
+                // the packets sent without ACK request wait for its WB
+                if (macQueue.size() > 0 || awaitingAck.size() > 0) {
+                    scheduleDataWakeup();
+                }
                 return;
             }
             if (msg->getKind() == DATA || msg->getKind() == WB) {
@@ -557,7 +997,8 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
             }
             break;
     }
-    if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK) {
+    if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK
+            || msg->getKind() == STROBE) {
         delete msg;
         msg = NULL;
         return;
@@ -571,6 +1012,17 @@ void TADMacLayer::handleSelfMsgSender(cMessage *msg) {
  *
  */
 void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
+    // the channel samples run beside the wakeup schedule, only while sleeping
+    if (msg->getKind() == SAMPLE) {
+        scheduleAt(simTime() + sampleInterval, sampleTimer);
+        if (macState == SLEEP) {
+            macState = SAMPLING;
+            changeMACState();
+            scheduleAt(simTime() + sampleDuration, sampleTimeout);
+            nbSamples++;
+        }
+        return;
+    }
     switch (macState) {
         // Call at first time after initialize the note
         case INIT:
@@ -578,6 +1030,9 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 macState = SLEEP;
                 changeMACState();
                 scheduleNextWakeup();
+                if (useUrgentStrobe) {
+                    scheduleAt(simTime() + uniform(0, sampleInterval), sampleTimer);
+                }
                 return;
             }
             break;
@@ -593,8 +1048,55 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 scheduleAt(startWake + waitCCA, ccaWBTimeout);
                 numberWakeup++;
 
-                nodeNumberWakeup[currentNode]++;
-                iwuVec[currentNode].record(nodeWakeupInterval[currentNode] * 1000);
+                if (!urgentWake) {
+                    nodeNumberWakeup[currentNode]++;
+                    iwuVec[currentNode].record(nodeWakeupInterval[currentNode] * 1000);
+                }
+                return;
+            }
+            break;
+        // This node listens for a STROBE
+        case SAMPLING:
+            if (msg->getKind() == SAMPLE_TIMEOUT) {
+                macState = SLEEP;
+                changeMACState();
+                sampleTime += sampleDuration;
+                return;
+            }
+            if (msg->getKind() == WAKE_UP || msg->getKind() == STROBE) {
+                sampleTime += sampleDuration - (sampleTimeout->getArrivalTime() - simTime()).dbl();
+                cancelEvent(sampleTimeout);
+                macState = SLEEP;
+                if (msg->getKind() == WAKE_UP) {
+                    // the scheduled wakeup ends the sample
+                    handleSelfMsgReceiver(msg);
+                    return;
+                }
+                macpkt_ptr_t mac = static_cast<macpkt_ptr_t>(msg);
+                int nodeId = 0;
+                for (int i = 1; i <= numberSender; i++) {
+                    if (routeTable[i] == mac->getSrcAddr()) {
+                        nodeId = i;
+                    }
+                }
+                if (mac->getDestAddr() == myMacAddr && nodeId > 0) {
+                    // answer with a WB now, the schedule goes on after this exchange
+                    cancelEvent(wakeup);
+                    currentNode = nodeId;
+                    urgentWake = true;
+                    nbUrgentWakes++;
+                    scheduleAt(simTime(), wakeup);
+                } else {
+                    changeMACState();
+                }
+                delete msg;
+                msg = NULL;
+                mac = NULL;
+                return;
+            }
+            if (msg->getKind() == DATA || msg->getKind() == WB || msg->getKind() == ACK) {
+                delete msg;
+                msg = NULL;
                 return;
             }
             break;
@@ -615,9 +1117,12 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 macState = WAIT_DATA;
                 changeMACState();
                 // Schedule wait data timeout event
-                scheduleAt(simTime() + waitDATA, rxDATATimeout);
+                scheduleAt(simTime() + getWaitDATA(), rxDATATimeout);
+                listenUntil = simTime() + waitDATA;
                 //nodeTwb[currentNode] = round((simTime().dbl() - nextWakeupTime[currentNode]) * 1000) / 1000;
-                nodeTwb[currentNode] = simTime().dbl();
+                if (!urgentWake) {
+                    nodeTwb[currentNode] = simTime().dbl();
+                }
                 return;
             }
             break;
@@ -627,7 +1132,16 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
             if (msg->getKind() == RX_DATA_TIMEOUT) {
                 macState = SLEEP;
                 changeMACState();
+                recordListenSaved();
 
+                // the interval is already calculated if the sender ended a burst,
+                // an urgent wakeup keeps the schedule
+                if (burstPending || urgentWake) {
+                    burstPending = false;
+                    urgentWake = false;
+                    scheduleNextWakeup();
+                    return;
+                }
                 // calculate next wakeup interval for current node
                 calculateNextInterval();
                 // schedule for next wakeup time
@@ -643,26 +1157,51 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
                 // If this data packet destination is not for this receiver
                 // wait for right data packet
                 if (dest != myMacAddr) {
+                    // the expected sender is served by another receiver: no need to wait for it
+                    if (useEarlySleep && src == routeTable[currentNode]) {
+                        cancelEvent(rxDATATimeout);
+                        scheduleAt(simTime(), rxDATATimeout);
+                    }
                     delete msg;
                     msg = NULL;
                     mac = NULL;
                     return;
                 }
+                // the sender took the short address of the WB
+                if (useCompactHeaders && static_cast<macpkttad_ptr_t>(msg)->getShortSrc() == currentNode) {
+                    shortConfirmed[currentNode] = true;
+                }
                 // cacel event
                 cancelEvent(rxDATATimeout);
-                // Calculate next wakeup interval
-                calculateNextInterval(msg);
+                // Calculate next wakeup interval, only once per wakeup
+                if (burstPending || urgentWake) {
+                    nbRxData[currentNode]++;
+                } else {
+                    calculateNextInterval(msg);
+                }
+                // the sender keeps the receiver awake for its next fragment as for a burst
+                burstPending = (useFramePending || static_cast<macpkttad_ptr_t>(msg)->getNbFragments() > 1)
+                        && static_cast<macpkttad_ptr_t>(msg)->getMoreData();
+                bool ackRequested = static_cast<macpkttad_ptr_t>(msg)->getAckRequested();
                 // send mac packet to upper layer
-                sendUp(decapsMsg(mac));
-                // if use ack
-                if (useMacAcks) {
+                sendUpData(static_cast<macpkttad_ptr_t>(msg));
+                // if use ack, the next WB confirms the DATA without ACK request
+                if (useMacAcks && ackRequested) {
                     macState = CCA_ACK;
                     changeMACState();
                     lastDataPktSrcAddr = src;
                     // reset cca attempt number
                     ccaAttempts = 0;
                     scheduleAt(simTime() + waitCCA, ccaACKTimeout);
+                } else if (burstPending) {
+                    // wait for the next packet of the sender
+                    scheduleAt(simTime() + waitDATA, rxDATATimeout);
+                    listenUntil = simTime() + waitDATA;
                 } else {
+                    macState = SLEEP;
+                    changeMACState();
+                    recordListenSaved();
+                    urgentWake = false;
                     // schedule for next wakeup time
                     scheduleNextWakeup();
                 }
@@ -680,14 +1219,30 @@ void TADMacLayer::handleSelfMsgReceiver(cMessage *msg) {
             break;
         case SENDING_ACK:
             if (msg->getKind() == ACK_SENT) {
+                // the sender announced more data: stay awake for it
+                if (burstPending) {
+                    macState = WAIT_DATA;
+                    changeMACState();
+                    scheduleAt(simTime() + waitDATA, rxDATATimeout);
+                    listenUntil = simTime() + waitDATA;
+                    return;
+                }
                 macState = SLEEP;
                 changeMACState();
+                recordListenSaved();
+                urgentWake = false;
                 // schedule for next wakeup time
                 scheduleNextWakeup();
                 return;
             }
             break;
     }
+    // a STROBE heard while awake for another sender: its sender strobes again
+    if (msg->getKind() == STROBE) {
+        delete msg;
+        msg = NULL;
+        return;
+    }
     opp_error("Undefined event of type %d in state %d (Radio state %d)!",
             msg->getKind(), macState, phy->getRadioState());
 }
@@ -699,6 +1254,201 @@ void TADMacLayer::updateTSR(int nodeId, int value) {
     TSR_bank[nodeId][TSR_length - 1] = value;
 }
 
+int TADMacLayer::getTSRValue(int packetCount) {
+    if (!useWeightedTSR || packetCount < 1) {
+        return 1;
+    }
+    return packetCount < tsrLevels ? packetCount : tsrLevels;
+}
+
+double TADMacLayer::getStep(int nodeId) {
+    if (useAdaptiveStep) {
+        return nodeStep[nodeId] * sysClock;
+    }
+    return sysClockFactor * sysClock;
+}
+
+/**
+ * AIMD on the step: additive increase after consecutive empty wakeups,
+ * multiplicative decrease when the prediction hits the data.
+ */
+void TADMacLayer::updateStep(int nodeId, bool received) {
+    if (!useAdaptiveStep) {
+        return;
+    }
+    if (received) {
+        nodeMissRun[nodeId] = 0;
+        nodeStep[nodeId] *= stepDecrease;
+        if (nodeStep[nodeId] < stepMin) {
+            nodeStep[nodeId] = stepMin;
+        }
+    } else {
+        nodeMissRun[nodeId]++;
+        // a single miss may be jitter, grow only on consecutive misses
+        if (nodeMissRun[nodeId] > 1) {
+            nodeStep[nodeId] += stepIncrease;
+            if (nodeStep[nodeId] > stepMax) {
+                nodeStep[nodeId] = stepMax;
+            }
+        }
+    }
+    stepVec[nodeId].record(nodeStep[nodeId]);
+}
+
+/**
+ * Keep the last sloWindow MAC delays reported by a sender, estimate their p95
+ * and adapt the interval cap: shrink it when the target is missed, grow it by
+ * one step while it is binding and the p95 is comfortably under the target.
+ */
+void TADMacLayer::updateLatencySLO(int nodeId, double delay) {
+    if (!useLatencySLO || nodeTargetDelay[nodeId] <= 0) {
+        return;
+    }
+    nodeDelay[nodeId][nodeDelayCount[nodeId] % sloWindow] = delay;
+    nodeDelayCount[nodeId]++;
+    if (nodeDelayCount[nodeId] < sloMinSamples) {
+        return;
+    }
+    int n = nodeDelayCount[nodeId] < sloWindow ? nodeDelayCount[nodeId] : sloWindow;
+    std::vector<double> samples(nodeDelay[nodeId], nodeDelay[nodeId] + n);
+    std::sort(samples.begin(), samples.end());
+    nodeP95[nodeId] = samples[int(ceil(0.95 * n)) - 1];
+    p95Vec[nodeId].record(nodeP95[nodeId] * 1000);
+
+    if (nodeP95[nodeId] > nodeTargetDelay[nodeId]) {
+        nodeSloCap[nodeId] *= 0.8;
+        if (nodeSloCap[nodeId] < sysClock) {
+            nodeSloCap[nodeId] = sysClock;
+        }
+    } else if (nodeP95[nodeId] < 0.8 * nodeTargetDelay[nodeId] && nodeSloCap[nodeId] <= nodeWakeupInterval[nodeId]) {
+        nodeSloCap[nodeId] += getStep(nodeId);
+    }
+}
+
+void TADMacLayer::updateDormancy(int nodeId, bool received) {
+    if (!useDormancy) {
+        return;
+    }
+    // a dormant sender is resumed by boundInterval, after the estimator
+    if (received) {
+        nodeEmptyRun[nodeId] = 0;
+        return;
+    }
+    nodeEmptyRun[nodeId]++;
+    if (!nodeDormant[nodeId] && nodeEmptyRun[nodeId] >= dormantThreshold) {
+        nodeDormant[nodeId] = true;
+        nodeActiveInterval[nodeId] = nodeWakeupInterval[nodeId];
+        nodeDormantInterval[nodeId] = nodeWakeupInterval[nodeId];
+        nbDormant[nodeId]++;
+    }
+}
+
+/**
+ * Bootstrap of a newly seen sender: average its first bootstrapSamples non
+ * zero iwu and jump to the estimated period. The data carried by the current
+ * frame was generated at wbTime - idle, the next one is due one period later.
+ */
+bool TADMacLayer::bootstrapInterval(int nodeId, double idle, double iwu, double wbTime) {
+    if (!useBootstrap || nodeBootDone[nodeId] || iwu <= 0) {
+        return false;
+    }
+    nodeBootSum[nodeId] += iwu;
+    nodeBootCount[nodeId]++;
+    if (nodeBootCount[nodeId] < bootstrapSamples) {
+        return false;
+    }
+    nodeBootDone[nodeId] = true;
+    double period = nodeBootSum[nodeId] / nodeBootCount[nodeId];
+    double next = wbTime - idle + period + sysClock;
+    while (next <= simTime().dbl()) {
+        next += period;
+    }
+    nodeWakeupIntervalLock[nodeId] = period;
+    nodeWakeupInterval[nodeId] = next - nextWakeupTime[nodeId];
+    markLocked(nodeId);
+    return true;
+}
+
+/**
+ * Schedule hint: the sender gives the exact time to its next packet & its
+ * period, the next wakeup is set just after that packet is generated.
+ */
+bool TADMacLayer::scheduleHintInterval(int nodeId, double nextSend, double iwu) {
+    if (!useScheduleHint || nextSend < 0 || iwu <= 0) {
+        return false;
+    }
+    nodeWakeupIntervalLock[nodeId] = iwu;
+    nodeWakeupInterval[nodeId] = simTime().dbl() + nextSend + sysClock - nextWakeupTime[nodeId];
+    markLocked(nodeId);
+    return true;
+}
+
+void TADMacLayer::markLocked(int nodeId) {
+    if (firstLockTime[nodeId] < 0) {
+        firstLockTime[nodeId] = simTime().dbl();
+    }
+}
+
+/**
+ * Track the age of information of a sender: the age just before this update
+ * is a peak, the freshest reading is taken from the creation time of the
+ * application packet carried by the frame.
+ */
+void TADMacLayer::updateAoI(int nodeId, cPacket *pkt, double iwu) {
+    if (!useAoI) {
+        return;
+    }
+    if (iwu > 0) {
+        nodePeriod[nodeId] = iwu;
+    }
+    while (pkt->getEncapsulatedPacket() != NULL) {
+        pkt = pkt->getEncapsulatedPacket();
+    }
+    if (nodeLastGen[nodeId] >= 0) {
+        aoiVec[nodeId].record(simTime().dbl() - nodeLastGen[nodeId]);
+    }
+    if (pkt->getCreationTime().dbl() > nodeLastGen[nodeId]) {
+        nodeLastGen[nodeId] = pkt->getCreationTime().dbl();
+    }
+}
+
+void TADMacLayer::boundInterval(int nodeId) {
+    // age of information: collect each reading before the next one within the energy budget
+    if (useAoI) {
+        if (nodePeriod[nodeId] > 0 && nodeWakeupInterval[nodeId] > nodePeriod[nodeId]) {
+            nodeWakeupInterval[nodeId] = nodePeriod[nodeId];
+        }
+        if (aoiMaxWakeRate > 0 && nodeWakeupInterval[nodeId] < 1 / aoiMaxWakeRate) {
+            nodeWakeupInterval[nodeId] = 1 / aoiMaxWakeRate;
+        }
+    }
+    if (useDormancy && nodeDormant[nodeId]) {
+        if (nodeEmptyRun[nodeId] == 0) {
+            // fast resume: never sleep longer than before the silence
+            nodeDormant[nodeId] = false;
+            if (nodeWakeupInterval[nodeId] > nodeActiveInterval[nodeId]) {
+                nodeWakeupInterval[nodeId] = nodeActiveInterval[nodeId];
+            }
+            nbDormantResume[nodeId]++;
+        } else {
+            // dormant sender: double the interval up to dormantMaxInterval, never shorten it
+            double backoff = 2 * std::max(nodeDormantInterval[nodeId], nodeWakeupInterval[nodeId]);
+            double cap = std::max(dormantMaxInterval, nodeActiveInterval[nodeId]);
+            if (backoff > cap) {
+                backoff = cap;
+            }
+            if (backoff > nodeWakeupInterval[nodeId]) {
+                nodeWakeupInterval[nodeId] = backoff;
+            }
+            nodeDormantInterval[nodeId] = nodeWakeupInterval[nodeId];
+        }
+    }
+    // latency SLO: never sleep longer than the cap of this sender
+    if (useLatencySLO && nodeTargetDelay[nodeId] > 0 && nodeWakeupInterval[nodeId] > nodeSloCap[nodeId]) {
+        nodeWakeupInterval[nodeId] = nodeSloCap[nodeId];
+    }
+}
+
 /**
  * Calculate next wakeup interval for current node
  */
@@ -714,13 +1464,27 @@ void TADMacLayer::calculateNextInterval(cMessage *msg) {
     double x1, x2;
     x1 = x2 = 0;
     // Move the array TSR to left to store the new value in TSR[TSR_lenth - 1]
-    updateTSR(currentNode, (msg == NULL) ? 0 : 1);
+    updateTSR(currentNode, (msg == NULL) ? 0 : getTSRValue(static_cast<macpkttad_ptr_t>(msg)->getPacketCount()));
+    updateStep(currentNode, msg != NULL);
+    updateDormancy(currentNode, msg != NULL);
+    if (msg != NULL) {
+        macpkttad_ptr_t mac = static_cast<macpkttad_ptr_t>(msg);
+        updateLatencySLO(currentNode, mac->getIdle() / 1000.0);
+        updateAoI(currentNode, mac, mac->getIwu() / 1000.0);
+        if (scheduleHintInterval(currentNode, mac->getNextSend() / 1000.0, mac->getIwu() / 1000.0)
+                || bootstrapInterval(currentNode, mac->getIdle() / 1000.0, mac->getIwu() / 1000.0, nodeTwb[currentNode])) {
+            boundInterval(currentNode);
+            nextWakeupTime[currentNode] += nodeWakeupInterval[currentNode];
+            return;
+        }
+    }
     // Calculate X1;
     for (int i = 0; i < TSR_length / 2; i++) {
-        if (TSR_bank[currentNode][i] == 1) {
-            n11++;
-            if (i > 0 && TSR_bank[currentNode][i - 1] == 1) {
-                nc11++;
+        if (TSR_bank[currentNode][i] > 0) {
+            // a busy slot weighs the number of packets it reported
+            n11 += TSR_bank[currentNode][i];
+            if (i > 0 && TSR_bank[currentNode][i - 1] > 0) {
+                nc11 += TSR_bank[currentNode][i];
             }
         } else {
             n01++;
@@ -732,10 +1496,10 @@ void TADMacLayer::calculateNextInterval(cMessage *msg) {
     x1 = double(n01 * nc01 * 2) / TSR_length - double(n11 * nc11 * 2) / TSR_length;
     // Calculate X2
     for (int i = TSR_length / 2; i < TSR_length; i++) {
-        if (TSR_bank[currentNode][i] == 1) {
-            n12++;
-            if (TSR_bank[currentNode][i - 1] == 1) {
-                nc12++;
+        if (TSR_bank[currentNode][i] > 0) {
+            n12 += TSR_bank[currentNode][i];
+            if (TSR_bank[currentNode][i - 1] > 0) {
+                nc12 += TSR_bank[currentNode][i];
             }
         } else {
             n02++;
@@ -876,10 +1640,11 @@ void TADMacLayer::calculateNextInterval(cMessage *msg) {
                     idle -= iwu;
                 }
                 nodeWakeupIntervalLock[currentNode] = iwu/1000;
+                markLocked(currentNode);
                 double tmp = nodeTwb[currentNode] + (iwu - idle)/1000 + 0.001;
                 nodeWakeupInterval[currentNode] = tmp - nextWakeupTime[currentNode];
             } else {
-                nodeWakeupInterval[currentNode] += sysClock * sysClockFactor;
+                nodeWakeupInterval[currentNode] += getStep(currentNode);
                 nodeWakeupInterval[currentNode] = round(nodeWakeupInterval[currentNode] * 1000.0) / 1000.0;
             }
         } else if (nodeWakeupIntervalLock[currentNode] > 0)  {
@@ -888,7 +1653,7 @@ void TADMacLayer::calculateNextInterval(cMessage *msg) {
     } else {
         nodeIdle[currentNode][0] = nodeIdle[currentNode][1] = -1;
         if (nodeWakeupIntervalLock[currentNode] * 1000 == 0) {
-            nodeWakeupInterval[currentNode] += mu * sysClockFactor * sysClock;
+            nodeWakeupInterval[currentNode] += mu * getStep(currentNode);
             nodeWakeupInterval[currentNode] = round(nodeWakeupInterval[currentNode] * 1000.0) / 1000.0;
             if (nodeWakeupInterval[currentNode] < 0.02) {
                 nodeWakeupInterval[currentNode] = 0.02;
@@ -898,6 +1663,7 @@ void TADMacLayer::calculateNextInterval(cMessage *msg) {
             nodeWakeupIntervalLock[currentNode] = 0;
         }
     }
+    boundInterval(currentNode);
     nextWakeupTime[currentNode] += nodeWakeupInterval[currentNode];
 }
 
@@ -934,6 +1700,9 @@ void TADMacLayer::handleLowerControl(cMessage *msg) {
         if (macState == SENDING_ACK) {
             scheduleAt(simTime(), ACKsent);
         }
+        if (macState == SENDING_STROBE) {
+            scheduleAt(simTime(), strobeSent);
+        }
     }
     // Radio switching (to RX or TX) ir over, ignore switching to SLEEP.
     else if (msg->getKind() == MacToPhyInterface::RADIO_SWITCHING_OVER) {
@@ -948,6 +1717,10 @@ void TADMacLayer::handleLowerControl(cMessage *msg) {
                 && (phy->getRadioState() == MiximRadio::TX)) {
             sendMacAck();
         }
+        if ((macState == SENDING_STROBE)
+                && (phy->getRadioState() == MiximRadio::TX)) {
+            sendStrobe();
+        }
 //        // we were waiting for acks, but none came. we switched to TX and now
 //        // need to resend data
         if ((macState == SENDING_DATA)
@@ -955,6 +1728,11 @@ void TADMacLayer::handleLowerControl(cMessage *msg) {
             sendDataPacket();
         }
 
+    } else if (msg->getKind() == BaseDecider::PACKET_DROPPED) {
+        // a DATA lost while waiting for it: count it as a collision
+        if (macState == WAIT_DATA) {
+            nbCollision++;
+        }
     } else {
         debugEV << "control message with wrong kind -- deleting\n";
     }
@@ -962,16 +1740,143 @@ void TADMacLayer::handleLowerControl(cMessage *msg) {
 }
 
 /**
- * Send wakeup beacon from receiver to sender
+ * Frame control & FCS, the addresses, then only the fields the frame carries:
+ * the next wakeup relative to now, one byte per sequence number, the timing
+ * fields of the DATA as varints & a varint length before each aggregated
+ * packet.
  */
-void TADMacLayer::sendWB() {
-    /**
-     * For multi sender, the WB packet must send to exactly sender, cannot broadcast
-     */
-    macpkt_ptr_t wb = new MacPkt();
-    wb->setSrcAddr(myMacAddr);
-    //wb->setDestAddr(LAddress::L2BROADCAST);
-    wb->setDestAddr(routeTable[currentNode]);
+long TADMacLayer::getCompactLength(macpkt_ptr_t frame, long payload) {
+    int bytes = COMPACT_FRAME_SIZE;
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(frame);
+    macpkttad_ptr_t data = dynamic_cast<macpkttad_ptr_t>(frame);
+    // the frames of the receiver use the short address once the sender took it
+    bool isShort;
+    if (frame->getKind() == DATA || frame->getKind() == STROBE) {
+        isShort = shortAddr.count(frame->getDestAddr()) > 0;
+    } else {
+        isShort = shortConfirmed[currentNode];
+    }
+    bytes += 2 * (isShort ? SHORT_ADDR_SIZE : FULL_ADDR_SIZE);
+    if (advert != NULL) {
+        if (useScheduleAdvert) {
+            bytes += varintLength(advert->getNextWakeup() - long(simTime().dbl() * 1000));
+        }
+        if (advert->getShortAddr() > 0) {
+            bytes += SHORT_ADDR_SIZE;
+        }
+        bytes += advert->getAckSeqArraySize();
+    }
+    if (data != NULL) {
+        // sequence number, idle & iwu
+        bytes += 1 + varintLength(data->getIdle()) + varintLength(data->getIwu());
+        if (data->getNbFragments() > 1) {
+            // fragment index & count on 4 bits each
+            bytes += 1;
+        }
+        if (data->getNextSend() >= 0) {
+            bytes += varintLength(data->getNextSend());
+        }
+        for (unsigned int i = 0; i < data->getPacketsArraySize(); i++) {
+            long bits = data->getPackets(i).getEncapsulatedPacket()->getBitLength();
+            bytes += 1 + varintLength((bits + 7) / 8);
+            payload += bits;
+        }
+    }
+    return bytes * 8 + payload;
+}
+
+/**
+ * The WB carries the sequence number of the last DATA the receiver got from
+ * each sender it confirms. The packets sent to the receiver up to it are
+ * delivered, the later ones go back to the front of the queue, or are
+ * dropped once maxTxAttempts WBs did not confirm them.
+ */
+void TADMacLayer::confirmImplicitAcks(cMessage *wb) {
+    macpkt_ptr_t mac = static_cast<macpkt_ptr_t>(wb);
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(wb);
+    long acked = -1;
+    if (advert != NULL) {
+        for (unsigned int i = 0; i < advert->getAckAddrArraySize(); i++) {
+            if (advert->getAckAddr(i) == myMacAddr) {
+                acked = advert->getAckSeq(i);
+            }
+        }
+    }
+    MacQueue lost;
+    MacQueue::iterator it = awaitingAck.begin();
+    while (it != awaitingAck.end()) {
+        if ((*it)->getDestAddr() != mac->getSrcAddr()) {
+            ++it;
+            continue;
+        }
+        long seq = (*it)->getSequenceId();
+        if (seq <= acked) {
+            nbImplicitAcks++;
+            recordClassDelay(*it);
+            implicitTxAttempts.erase(seq);
+            delete *it;
+        } else if (++implicitTxAttempts[seq] < maxTxAttempts) {
+            nbImplicitRetries++;
+            nbRetransmissions++;
+            lost.push_back(*it);
+        } else {
+            implicitTxAttempts.erase(seq);
+            if (usePriority) {
+                nbClassDropped[getPacketClass(*it)]++;
+            }
+            delete *it;
+            nbDroppedDataPackets++;
+            droppedPacket.setReason(DroppedPacket::RETRIES);
+            emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+        }
+        it = awaitingAck.erase(it);
+    }
+    macQueue.splice(macQueue.begin(), lost);
+}
+
+double TADMacLayer::getWaitDATA() {
+    // the expected senders are declared lost after lostSenderTimeout
+    if (useEarlySleep && lostSenderTimeout > 0 && lostSenderTimeout < waitDATA) {
+        return lostSenderTimeout;
+    }
+    return waitDATA;
+}
+
+void TADMacLayer::recordListenSaved() {
+    if (useEarlySleep) {
+        double saved = listenUntil > simTime() ? (listenUntil - simTime()).dbl() : 0;
+        listenSavedVec.record(saved * 1000);
+        listenSaved += saved;
+    }
+}
+
+/**
+ * Send wakeup beacon from receiver to sender
+ */
+void TADMacLayer::sendWB() {
+    /**
+     * For multi sender, the WB packet must send to exactly sender, cannot broadcast
+     */
+    macpkt_ptr_t wb;
+    macpktwb_ptr_t advert = NULL;
+    if (useScheduleAdvert || useImplicitAck || useCompactHeaders) {
+        advert = new MacPktWB();
+        // advertise the next wakeup for this sender if its interval does not change
+        if (useScheduleAdvert) {
+            // an urgent wakeup is out of the schedule, the scheduled one is still next
+            double next = nextWakeupTime[currentNode];
+            if (!urgentWake) {
+                next += nodeWakeupInterval[currentNode];
+            }
+            advert->setNextWakeup(long(next * 1000));
+        }
+        wb = advert;
+    } else {
+        wb = new MacPkt();
+    }
+    wb->setSrcAddr(myMacAddr);
+    //wb->setDestAddr(LAddress::L2BROADCAST);
+    wb->setDestAddr(routeTable[currentNode]);
 
     ostringstream converter;
     converter << "WB_" << currentNode;
@@ -979,6 +1884,25 @@ void TADMacLayer::sendWB() {
     wb->setName(converter.str().c_str());
     wb->setKind(WB);
     wb->setBitLength(headerLength);
+    if (useScheduleAdvert) {
+        // 4 bytes for the next wakeup
+        wb->addBitLength(32);
+    }
+    if (useImplicitAck && lastSeq[currentNode] >= 0) {
+        // 4 bytes for the last sequence number received from the sender
+        advert->setAckAddrArraySize(1);
+        advert->setAckSeqArraySize(1);
+        advert->setAckAddr(0, routeTable[currentNode]);
+        advert->setAckSeq(0, lastSeq[currentNode]);
+        wb->addBitLength(32);
+    }
+    if (useCompactHeaders) {
+        // the sender keeps its index as short address
+        if (!shortConfirmed[currentNode]) {
+            advert->setShortAddr(currentNode);
+        }
+        wb->setBitLength(getCompactLength(wb, 0));
+    }
 
     //attach signal and send down
     attachSignal(wb);
@@ -986,16 +1910,249 @@ void TADMacLayer::sendWB() {
     nbTxWB++;
 }
 
+void TADMacLayer::updateRendezvous(cMessage *msg) {
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(msg);
+    if (useScheduleAdvert && advert != NULL) {
+        nextRendezvous = advert->getNextWakeup() / 1000.0;
+    }
+}
+
+/**
+ * Wake up just before the predicted rendezvous, or now if it is unknown or
+ * already passed. With deferred transmission the oldest packet in the queue
+ * is never held more than maxHoldTime.
+ */
+simtime_t TADMacLayer::getDataWakeup() {
+    double now = simTime().dbl();
+    double wakeup = now;
+    if (useScheduleAdvert || deferTransmission) {
+        wakeup = predictRendezvous() - advertGuard;
+    }
+    if (deferTransmission && !macQueue.empty()) {
+        double deadline = macQueue.front()->getCreationTime().dbl() + maxHoldTime;
+        if (wakeup > deadline) {
+            wakeup = deadline;
+        }
+    }
+    return wakeup > now ? wakeup : now;
+}
+
+void TADMacLayer::scheduleDataWakeup() {
+    if (wakeupDATA->isScheduled()) {
+        cancelEvent(wakeupDATA);
+    }
+    scheduleAt(getDataWakeup(), wakeupDATA);
+}
+
+/**
+ * Listening time before giving up the WB: a high quantile of the last waits
+ * for the receiver of the first packet in the queue plus a margin, never
+ * more than waitWB.
+ */
+double TADMacLayer::getWaitWB() {
+    double timeout = waitWB;
+    if (useAdaptiveWaitWB && !wbProbe && !macQueue.empty()) {
+        timeout = getDestWaitWB(macQueue.front()->getDestAddr());
+        // listen until the latest WB expected from the receivers with packets
+        if (usePerDestQueues) {
+            for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+                double destTimeout = getDestWaitWB((*it)->getDestAddr());
+                if (destTimeout > timeout) {
+                    timeout = destTimeout;
+                }
+            }
+        }
+    }
+    wbTimeoutVec.record(timeout * 1000);
+    return timeout;
+}
+
+double TADMacLayer::getDestWaitWB(const LAddress::L2Type& dest) {
+    double timeout = waitWB;
+    std::list<double>& waits = wbWaits[dest];
+    if (int(waits.size()) >= wbWaitMinSamples) {
+        std::vector<double> samples(waits.begin(), waits.end());
+        std::sort(samples.begin(), samples.end());
+        double quantile = samples[int(ceil(waitWBQuantile * samples.size())) - 1];
+        if (quantile + waitWBMargin < timeout) {
+            timeout = quantile + waitWBMargin;
+        }
+    }
+    return timeout;
+}
+
+void TADMacLayer::updateWaitWB(double wait) {
+    wbProbe = false;
+    if (!useAdaptiveWaitWB || macQueue.empty()) {
+        return;
+    }
+    std::list<double>& waits = wbWaits[macQueue.front()->getDestAddr()];
+    waits.push_back(wait);
+    if (int(waits.size()) > wbWaitWindow) {
+        waits.pop_front();
+    }
+}
+
+bool TADMacLayer::isUrgent(cPacket *pkt) {
+    return usePriority && getPacketClass(pkt) <= urgentClass;
+}
+
+/**
+ * Like X-MAC, the sender of an urgent packet repeats short STROBEs to its
+ * receiver, listening for the WB between two of them. The train lasts one
+ * sampleInterval plus one sample so that a sleeping receiver samples it once.
+ */
+bool TADMacLayer::startStrobes() {
+    MacQueue::iterator it = macQueue.begin();
+    while (it != macQueue.end() && !isUrgent(*it)) {
+        it++;
+    }
+    // the urgent packet was not queued
+    if (it == macQueue.end()) {
+        return false;
+    }
+    strobeDest = (*it)->getDestAddr();
+    if (wakeupDATA->isScheduled()) {
+        cancelEvent(wakeupDATA);
+    }
+    if (macState == WAIT_WB) {
+        cancelEvent(rxWBTimeout);
+    } else {
+        startWake = simTime();
+        listenStart = simTime();
+        numberWakeup++;
+    }
+    strobing = true;
+    strobeEnd = simTime() + sampleInterval + sampleDuration;
+    macState = SENDING_STROBE;
+    changeMACState();
+    return true;
+}
+
+void TADMacLayer::sendStrobe() {
+    macpkt_ptr_t strobe = new MacPkt();
+    strobe->setSrcAddr(myMacAddr);
+    strobe->setDestAddr(strobeDest);
+    strobe->setName("STROBE");
+    strobe->setKind(STROBE);
+    strobe->setBitLength(headerLength);
+    if (useCompactHeaders) {
+        strobe->setBitLength(getCompactLength(strobe, 0));
+    }
+
+    //attach signal and send down
+    attachSignal(strobe);
+    sendDown(strobe);
+    nbStrobes++;
+}
+
+/**
+ * The WB obtained by a strobe train goes to the urgent packet as soon as the
+ * packets waiting for a retry are sent: they keep their sequence number &
+ * attempts, so the receiver never sees a packet numbered again and the
+ * sequence numbers reach it in order.
+ */
+void TADMacLayer::serveUrgent(const LAddress::L2Type& dest) {
+    MacQueue::iterator first = macQueue.begin();
+    while (first != macQueue.end() && (*first)->getSequenceId() >= 0) {
+        first++;
+    }
+    MacQueue::iterator it = first;
+    while (it != macQueue.end() && (!isUrgent(*it) || (*it)->getDestAddr() != dest)) {
+        it++;
+    }
+    // already sent, or expired
+    if (it == macQueue.end()) {
+        return;
+    }
+    macQueue.splice(first, macQueue, it);
+}
+
+/**
+ * A WB overheard from a receiver to another sender: the receiver is awake &
+ * busy with that sender for about waitDATA + waitACK. If our own rendezvous
+ * with it, predicted from our last WB & data interval, falls after the end
+ * of the listen window, this wake cannot succeed: sleep until just before
+ * that rendezvous. If it is already due, keep listening until the receiver
+ * is free again.
+ */
+void TADMacLayer::handleOverheardWB(macpkt_ptr_t wb) {
+    nbOverheardWB++;
+    double now = simTime().dbl();
+    NeighborWB& neighbor = neighborWB[wb->getSrcAddr()];
+    neighbor.lastHeard = now;
+    neighbor.busyUntil = now + waitDATA + waitACK;
+    if (!useOverheardWB || macQueue.empty() || wb->getSrcAddr() != macQueue.front()->getDestAddr()) {
+        return;
+    }
+    // packets for other receivers: their WB may still come in this window
+    if (usePerDestQueues && countDestPackets(wb->getSrcAddr()) < int(macQueue.size())) {
+        return;
+    }
+    double next = -1;
+    if (neighbor.lastOwn >= 0 && newIwu > 0) {
+        next = neighbor.lastOwn + ceil((now - neighbor.lastOwn) / newIwu) * newIwu;
+    }
+    double deadline = rxWBTimeout->getArrivalTime().dbl();
+    if (next < 0 || next <= neighbor.busyUntil) {
+        // our turn comes once the receiver is done with the other sender
+        if (deadline < neighbor.busyUntil + waitCCA) {
+            cancelEvent(rxWBTimeout);
+            scheduleAt(neighbor.busyUntil + waitCCA, rxWBTimeout);
+        }
+    } else if (next - advertGuard > deadline) {
+        nbSkippedListen++;
+        cancelEvent(rxWBTimeout);
+        macState = SLEEP;
+        changeMACState();
+        iwuVec[1].record((now - listenStart.dbl()) * 1000);
+        if (wakeupDATA->isScheduled()) {
+            cancelEvent(wakeupDATA);
+        }
+        scheduleAt(next - advertGuard, wakeupDATA);
+    }
+}
+
+/**
+ * Next WB from the receiver: the advertised one if known, else the last WB
+ * shifted by a whole number of data intervals, the receiver being locked on
+ * the traffic of this node.
+ */
+double TADMacLayer::predictRendezvous() {
+    double now = simTime().dbl();
+    if (useScheduleAdvert && nextRendezvous > now) {
+        return nextRendezvous;
+    }
+    if (deferTransmission && lastWB >= 0 && newIwu > 0) {
+        return lastWB + ceil((now - lastWB) / newIwu) * newIwu;
+    }
+    return now;
+}
+
 /**
  * Send one short preamble packet immediately.
  */
 void TADMacLayer::sendMacAck() {
-    macpkt_ptr_t ack = new MacPkt();
+    macpkt_ptr_t ack;
+    if (useScheduleAdvert) {
+        // the next wakeup for this sender is already calculated
+        macpktwb_ptr_t advert = new MacPktWB();
+        advert->setNextWakeup(long(nextWakeupTime[currentNode] * 1000));
+        ack = advert;
+    } else {
+        ack = new MacPkt();
+    }
     ack->setSrcAddr(myMacAddr);
     ack->setDestAddr(lastDataPktSrcAddr);
     ack->setName("ACK");
     ack->setKind(ACK);
     ack->setBitLength(headerLength);
+    if (useScheduleAdvert) {
+        ack->addBitLength(32);
+    }
+    if (useCompactHeaders) {
+        ack->setBitLength(getCompactLength(ack, 0));
+    }
 
     //attach signal and send down
     attachSignal(ack);
@@ -1006,23 +2163,445 @@ void TADMacLayer::sendMacAck() {
 
 void TADMacLayer::sendDataPacket() {
     nbTxDataPackets++;
+    // strict priority: the first packet of the most urgent class goes first,
+    // unless the front packet was already sent & waits for its ACK
+    if (usePriority && macQueue.front()->getSequenceId() < 0) {
+        MacQueue::iterator first = macQueue.begin();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            // the WB served one receiver, stay on its packets
+            if (usePerDestQueues && (*it)->getDestAddr() != (*first)->getDestAddr()) {
+                continue;
+            }
+            if (getPacketClass(*it) < getPacketClass(*first)) {
+                first = it;
+            }
+        }
+        macQueue.splice(macQueue.begin(), macQueue, first);
+    }
+    if (macQueue.front()->getSequenceId() < 0) {
+        macQueue.front()->setSequenceId(seqNum++);
+    }
     macpkt_ptr_t tmp = macQueue.front()->dup();
     macpkttad_ptr_t pkt = new MacPktTAD();
     pkt->setDestAddr(tmp->getDestAddr());
     pkt->setSrcAddr(tmp->getSrcAddr());
-    pkt->encapsulate(tmp->decapsulate());
+    pkt->setSequenceId(tmp->getSequenceId());
+    // the fragments of a packet are acknowledged one by one
+    implicitAckSent = useImplicitAck && role == NODE_SENDER
+            && getPacketClass(macQueue.front()) >= implicitAckClass && getFragmentCount(tmp) == 1;
+    pkt->setAckRequested(!implicitAckSent);
+    long payload = tmp->getEncapsulatedPacket()->getBitLength();
+    int fragments = getFragmentCount(tmp);
+    if (fragments > 1) {
+        // the packet travels with its last fragment
+        pkt->setFragment(txFragment);
+        pkt->setNbFragments(fragments);
+        if (txFragment == fragments - 1) {
+            pkt->encapsulate(tmp->decapsulate());
+        }
+        nbTxFragments++;
+    } else {
+        pkt->encapsulate(tmp->decapsulate());
+    }
 
     lastDataPktDestAddr = pkt->getDestAddr();
     pkt->setName("DATA");
     pkt->setKind(DATA);
-    pkt->setByteLength(16);
+    // payload bits carried by the DATA
+    long carried = 16 * 8 - headerLength;
+    if (useRealLength) {
+        if (fragments > 1) {
+            // share of the payload + 2 bytes of fragment header
+            long share = maxFramePayload * 8;
+            if (txFragment == fragments - 1) {
+                share = payload - (fragments - 1) * share;
+            }
+            pkt->setBitLength(headerLength + share + 16);
+            carried = share;
+        } else {
+            pkt->setBitLength(headerLength + payload);
+            carried = payload;
+        }
+    } else {
+        pkt->setByteLength(16);
+    }
     pkt->setIdle(int(timeWaitWB.dbl() * 1000));
     pkt->setIwu(int(newIwu * 1000));
+    // aggregate the next packets for the same destination while the airtime allows it
+    aggregated = 1;
+    if (maxAggregationAirtime > 0 && fragments == 1) {
+        MacQueue::iterator it = macQueue.begin();
+        for (++it; it != macQueue.end() && (*it)->getDestAddr() == pkt->getDestAddr(); ++it) {
+            if (getFragmentCount(*it) > 1) {
+                break;
+            }
+            // 2 bytes of sub header for each aggregated packet
+            double bits = (*it)->getEncapsulatedPacket()->getBitLength() + 16;
+            if ((pkt->getBitLength() + bits) / bitrate > maxAggregationAirtime) {
+                break;
+            }
+            macpkttad_ptr_t sub = new MacPktTAD();
+            sub->setDestAddr((*it)->getDestAddr());
+            sub->setSrcAddr((*it)->getSrcAddr());
+            if ((*it)->getSequenceId() < 0) {
+                (*it)->setSequenceId(seqNum++);
+            }
+            sub->setSequenceId((*it)->getSequenceId());
+            sub->encapsulate((*it)->getEncapsulatedPacket()->dup());
+            pkt->setPacketsArraySize(aggregated);
+            pkt->setPackets(aggregated - 1, *sub);
+            pkt->addBitLength(long(bits));
+            delete sub;
+            aggregated++;
+        }
+    }
+    // with per destination queues only the packets for this receiver are pending
+    int pending = usePerDestQueues ? countDestPackets(pkt->getDestAddr()) : macQueue.size();
+    pkt->setPacketCount(pending);
+    // a DATA without ACK request ends the rendezvous
+    moreDataSent = ((useFramePending && pending > aggregated) || txFragment < fragments - 1)
+            && !implicitAckSent;
+    if (useScheduleHint && nextSendTime > simTime().dbl()) {
+        pkt->setNextSend(long((nextSendTime - simTime().dbl()) * 1000));
+        pkt->addBitLength(16);
+    }
+    pkt->setMoreData(moreDataSent);
+    if (useCompactHeaders) {
+        if (shortAddr.count(pkt->getDestAddr()) > 0) {
+            pkt->setShortSrc(shortAddr[pkt->getDestAddr()]);
+        }
+        pkt->setBitLength(getCompactLength(pkt, carried));
+    }
     attachSignal(pkt);
     sendDown(pkt);
     delete tmp;
 }
 
+/**
+ * Send up the packet carried by a DATA then the packets aggregated in it.
+ */
+void TADMacLayer::sendUpData(macpkttad_ptr_t mac) {
+    // a fragment is only acknowledged until its packet is complete
+    if (mac->getNbFragments() > 1 && !reassemble(currentNode, mac)) {
+        delete mac;
+        return;
+    }
+    // copy the aggregated packets before decapsMsg deletes the frame
+    std::vector<macpkt_ptr_t> packets;
+    for (unsigned int i = 0; i < mac->getPacketsArraySize(); i++) {
+        packets.push_back(mac->getPackets(i).dup());
+    }
+    // a retransmitted packet already received is only acknowledged
+    if (acceptSequence(currentNode, mac->getSequenceId())) {
+        sendUp(decapsMsg(mac));
+    } else {
+        delete mac;
+    }
+    for (unsigned int i = 0; i < packets.size(); i++) {
+        nbRxDataPackets++;
+        if (acceptSequence(currentNode, packets[i]->getSequenceId())) {
+            sendUp(decapsMsg(packets[i]));
+        } else {
+            delete packets[i];
+        }
+    }
+}
+
+/**
+ * Traffic class of a packet, 0 if priority is not used.
+ */
+int TADMacLayer::getPacketClass(cPacket *pkt) {
+    if (!usePriority) {
+        return 0;
+    }
+    int trafficClass = getTrafficClass(pkt);
+    if (trafficClass < 0) {
+        return 0;
+    }
+    return trafficClass < trafficClasses ? trafficClass : trafficClasses - 1;
+}
+
+/**
+ * Priority-aware drop: a class over its own limit loses the new packet, a
+ * full queue evicts the newest packet of the least urgent class below it.
+ */
+bool TADMacLayer::makeRoom(int trafficClass) {
+    int count = 0;
+    MacQueue::iterator victim = macQueue.end();
+    for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+        int packetClass = getPacketClass(*it);
+        if (packetClass == trafficClass) {
+            count++;
+        }
+        // a packet already sent stays until it is acknowledged
+        if (packetClass > trafficClass && (*it)->getSequenceId() < 0
+                && (victim == macQueue.end() || packetClass >= getPacketClass(*victim))) {
+            victim = it;
+        }
+    }
+    if (count >= classQueueLength[trafficClass]) {
+        return false;
+    }
+    if (macQueue.size() < queueLength) {
+        return true;
+    }
+    if (victim == macQueue.end()) {
+        return false;
+    }
+    dropQueuedPacket(victim, DroppedPacket::QUEUE);
+    return true;
+}
+
+/**
+ * The packets for dest keep their order & go before the packets for the
+ * other receivers. The attempts of the packet set aside are kept until its
+ * receiver is served again.
+ */
+bool TADMacLayer::serveDestination(const LAddress::L2Type& dest) {
+    if (macQueue.empty()) {
+        return false;
+    }
+    const LAddress::L2Type front = macQueue.front()->getDestAddr();
+    // a packet half sent in fragments is finished first
+    if (front == dest || txFragment > 0) {
+        return front == dest;
+    }
+    MacQueue served;
+    MacQueue::iterator it = macQueue.begin();
+    while (it != macQueue.end()) {
+        MacQueue::iterator next = it;
+        ++next;
+        if ((*it)->getDestAddr() == dest) {
+            served.splice(served.end(), macQueue, it);
+        }
+        it = next;
+    }
+    if (served.empty()) {
+        return false;
+    }
+    macQueue.splice(macQueue.begin(), served);
+    destTxAttempts[front] = txAttempts;
+    txAttempts = destTxAttempts[dest];
+    destTxAttempts.erase(dest);
+    return true;
+}
+
+int TADMacLayer::countDestPackets(const LAddress::L2Type& dest) {
+    int count = 0;
+    for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+        if ((*it)->getDestAddr() == dest) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Queue discipline applied before queueing a new packet: at most
+ * destQueueLength packets for one destination, and with dropOldest a full
+ * queue loses its oldest packet not sent yet instead of the new one. With
+ * priority the victim is the oldest packet of the least urgent class, never
+ * more urgent than the new one, and nothing is dropped for a new packet its
+ * class limit refuses anyway. Return false with the drop reason if the new
+ * packet has to be dropped.
+ */
+bool TADMacLayer::applyQueueDiscipline(const LAddress::L2Type& dest, int trafficClass, int& reason) {
+    if (usePriority) {
+        int count = 0;
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if (getPacketClass(*it) == trafficClass) {
+                count++;
+            }
+        }
+        if (count >= classQueueLength[trafficClass]) {
+            return false;
+        }
+    }
+    if (destQueueLength > 0) {
+        int count = 0;
+        MacQueue::iterator oldest = macQueue.end();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if ((*it)->getDestAddr() == dest) {
+                count++;
+                if (isDropVictim(it, oldest, trafficClass)) {
+                    oldest = it;
+                }
+            }
+        }
+        if (count >= destQueueLength) {
+            if (!dropOldest || oldest == macQueue.end()) {
+                nbDestDropped++;
+                reason = DROP_DEST_LIMIT;
+                return false;
+            }
+            nbDestDropped++;
+            dropQueuedPacket(oldest, DROP_DEST_LIMIT);
+        }
+    }
+    if (dropOldest && macQueue.size() >= queueLength) {
+        MacQueue::iterator oldest = macQueue.end();
+        for (MacQueue::iterator it = macQueue.begin(); it != macQueue.end(); ++it) {
+            if (isDropVictim(it, oldest, trafficClass)) {
+                oldest = it;
+            }
+        }
+        if (oldest != macQueue.end()) {
+            nbDroppedOldest++;
+            dropQueuedPacket(oldest, DROP_OLDEST);
+        }
+    }
+    return true;
+}
+
+bool TADMacLayer::isDropVictim(MacQueue::iterator it, MacQueue::iterator victim, int trafficClass) {
+    // a packet already sent stays until it is acknowledged
+    if ((*it)->getSequenceId() >= 0) {
+        return false;
+    }
+    // the queue is scanned from the oldest packet
+    if (!usePriority) {
+        return victim == macQueue.end();
+    }
+    int packetClass = getPacketClass(*it);
+    if (packetClass < trafficClass) {
+        return false;
+    }
+    return victim == macQueue.end() || packetClass > getPacketClass(*victim);
+}
+
+/**
+ * Drop the packets older than maxPacketAge before a DATA is sent, a packet
+ * already sent waits for its ACK or for retry exhaustion. Return true if
+ * there is still data to send.
+ */
+bool TADMacLayer::dropExpiredPackets() {
+    if (maxPacketAge > 0) {
+        MacQueue::iterator it = macQueue.begin();
+        while (it != macQueue.end()) {
+            if ((*it)->getSequenceId() < 0 && simTime() - (*it)->getCreationTime() > maxPacketAge) {
+                nbExpired++;
+                it = dropQueuedPacket(it, DROP_EXPIRED);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return macQueue.size() > 0;
+}
+
+TADMacLayer::MacQueue::iterator TADMacLayer::dropQueuedPacket(MacQueue::iterator it, int reason) {
+    if (usePriority) {
+        nbClassDropped[getPacketClass(*it)]++;
+    }
+    droppedPacket.setReason(reason);
+    emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+    nbDroppedDataPackets++;
+    // the front packet may be half sent in fragments
+    if (it == macQueue.begin()) {
+        txFragment = 0;
+    }
+    delete *it;
+    return macQueue.erase(it);
+}
+
+void TADMacLayer::recordClassDelay(macpkt_ptr_t pkt) {
+    if (usePriority) {
+        classDelayVec[getPacketClass(pkt)].record((simTime() - pkt->getCreationTime()).dbl() * 1000);
+    }
+    if (useUrgentStrobe && isUrgent(pkt)) {
+        urgentDelayVec.record((simTime() - pkt->getCreationTime()).dbl() * 1000);
+    }
+}
+
+/**
+ * The contention window starts at 2^minBE slots, doubled for each doubling
+ * of the number of senders the receiver expects in its WB.
+ */
+void TADMacLayer::startBackoff(cMessage *wb) {
+    backoffExponent = minBE;
+    macpktwb_ptr_t advert = dynamic_cast<macpktwb_ptr_t>(wb);
+    int senders = (advert != NULL) ? advert->getExpectedSenders() : 1;
+    while ((1 << (backoffExponent - minBE)) < senders && backoffExponent < maxBE) {
+        backoffExponent++;
+    }
+}
+
+/**
+ * Random backoff before sensing the channel, 0 if backoff is not used.
+ */
+double TADMacLayer::getBackoff() {
+    if (!useBackoff) {
+        return 0;
+    }
+    return intuniform(0, (1 << backoffExponent) - 1) * backoffSlot;
+}
+
+/**
+ * Number of frames needed to carry a packet of maxFramePayload bytes each.
+ */
+int TADMacLayer::getFragmentCount(macpkt_ptr_t pkt) {
+    if (!useRealLength || maxFramePayload <= 0) {
+        return 1;
+    }
+    long payload = pkt->getEncapsulatedPacket()->getByteLength();
+    return payload > maxFramePayload ? int((payload + maxFramePayload - 1) / maxFramePayload) : 1;
+}
+
+/**
+ * The sender moves to the next fragment only once the previous one is
+ * acknowledged, so the fragments of a packet come in order, possibly
+ * repeated. A new sequence number starts a new packet.
+ */
+bool TADMacLayer::reassemble(int nodeId, macpkttad_ptr_t mac) {
+    if (mac->getSequenceId() != fragSeq[nodeId]) {
+        fragSeq[nodeId] = mac->getSequenceId();
+        fragNext[nodeId] = 0;
+    }
+    // a fragment repeated because its ACK was lost
+    if (mac->getFragment() != fragNext[nodeId]) {
+        return false;
+    }
+    fragNext[nodeId]++;
+    if (fragNext[nodeId] == mac->getNbFragments()) {
+        nbReassembled++;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Duplicate filter: the sender numbers its packets in order and resends the
+ * oldest one until it is acknowledged or dropped, so a sequence number not
+ * above the last one accepted from this sender is a duplicate.
+ */
+bool TADMacLayer::acceptSequence(int nodeId, long seq) {
+    if (seq <= lastSeq[nodeId]) {
+        nbDuplicates++;
+        return false;
+    }
+    lastSeq[nodeId] = seq;
+    return true;
+}
+
+/**
+ * Give up the packets carried by the last DATA after maxTxAttempts.
+ */
+void TADMacLayer::dropTxPackets() {
+    // only the packets carried by the failed DATA
+    for (int i = 0; i < aggregated && macQueue.size() > 0; i++) {
+        if (usePriority) {
+            nbClassDropped[getPacketClass(macQueue.front())]++;
+        }
+        delete macQueue.front();
+        macQueue.pop_front();
+        nbDroppedDataPackets++;
+    }
+    droppedPacket.setReason(DroppedPacket::RETRIES);
+    emit(BaseLayer::catDroppedPacketSignal, &droppedPacket);
+    txAttempts = 0;
+    txFragment = 0;
+}
+
 void TADMacLayer::attachSignal(macpkt_ptr_t macPkt) {
     //calc signal duration
     simtime_t duration = macPkt->getBitLength() / bitrate;
@@ -25,12 +25,14 @@
 #include <sstream>
 #include <vector>
 #include <list>
+#include <map>
 #include <fstream>
 
 #include "MiXiMDefs.h"
 #include "BaseMacLayer.h"
 #include <DroppedPacket.h>
 #include <MacPktTAD_m.h>
+#include <MacPktWB_m.h>
 
 using namespace std;
 
@@ -68,6 +70,7 @@ public:
     {}
 
     typedef MacPktTAD* macpkttad_ptr_t;
+    typedef MacPktWB* macpktwb_ptr_t;
 
     virtual ~TADMacLayer();
 
@@ -126,10 +129,72 @@ protected:
 
     int TSR[16];
     int TSR_length;
+    /**
+     * Weighted TSR: store the queue size reported by the sender (up to
+     * tsrLevels) instead of 1 so that bursts weigh more in the correlator.
+     */
+    bool useWeightedTSR;
+    int tsrLevels;
     /** @brief store the moment wakeup, will be used to calculate the rest time */
     simtime_t startWake;
     /** store the moment the sender wait for WB */
     simtime_t timeWaitWB;
+    /** @brief store the moment the radio is turned on to wait for WB */
+    simtime_t listenStart;
+    /**
+     * Frame pending: DATA frames announce more packets in the queue, the
+     * receiver stays awake & ACKs back to back so that the sender drains its
+     * whole queue in one rendezvous.
+     */
+    bool useFramePending;
+    /** @brief receiver: the last DATA announced more data */
+    bool burstPending;
+    /** @brief sender: the last DATA sent announced more data */
+    bool moreDataSent;
+    /** @brief sender: moment the WB of the current rendezvous was received */
+    simtime_t rendezvousStart;
+    /** @brief Ouput vector tracking the time to drain the queue in one rendezvous.*/
+    cOutVector drainVec;
+    /**
+     * Aggregation: the next queued packets for the same destination are
+     * packed in packets[] while the frame airtime stays under
+     * maxAggregationAirtime, 0 = no aggregation.
+     */
+    double maxAggregationAirtime;
+    /** @brief number of packets carried by the last DATA sent */
+    int aggregated;
+    /**
+     * Adaptive WB wait: the sender listens for a WB only up to a high
+     * quantile of its last waits for the same receiver plus a margin.
+     */
+    bool useAdaptiveWaitWB;
+    double waitWBQuantile;
+    double waitWBMargin;
+    /** @brief last WB waits of the sender for each receiver */
+    std::map<LAddress::L2Type, std::list<double> > wbWaits;
+    static const int wbWaitWindow = 20;
+    static const int wbWaitMinSamples = 5;
+    /** @brief the last wait timed out, listen the whole waitWB once */
+    bool wbProbe;
+    long nbWBTimeouts;
+    /** @brief Ouput vector tracking the WB wait timeout of the sender.*/
+    cOutVector wbTimeoutVec;
+    /**
+     * Schedule advertisement: the receiver puts its next wakeup for the
+     * sender in each WB & ACK, the sender sleeps until advertGuard before it.
+     */
+    bool useScheduleAdvert;
+    double advertGuard;
+    /** @brief next rendezvous advertised by the receiver, -1 if unknown */
+    double nextRendezvous;
+    /**
+     * Deferred transmission: new data waits asleep in the queue until the
+     * predicted rendezvous, but the oldest packet never more than maxHoldTime.
+     */
+    bool deferTransmission;
+    double maxHoldTime;
+    /** @brief moment the last WB for this node was received, -1 if never */
+    double lastWB;
 
     double wakeupInterval;
     double waitCCA;
@@ -153,7 +218,10 @@ protected:
         SENDING_WB,     //7
         WAIT_DATA,      //8
         CCA_ACK,        //9
-        SENDING_ACK     //10
+        SENDING_ACK,    //10
+        // The stages for urgent packets
+        SENDING_STROBE, //11
+        SAMPLING        //12
     };
     /** @brief The current state of the protocol */
     States macState;
@@ -180,7 +248,12 @@ protected:
         // The message used to transmit between the node
         WB,              //15   // WB packet
         DATA,            //16   // DATA packet received from network upper layer or physical lower layer
-        ACK              //17   // ACK packet
+        ACK,             //17   // ACK packet
+        // The messages used for urgent packets
+        STROBE,          //18   // STROBE packet, the sender asks an immediate WB
+        STROBE_SENT,     //19   // current state SENDING_STROBE, next state WAIT_WB
+        SAMPLE,          //20   // Current state SLEEP, next state SAMPLING
+        SAMPLE_TIMEOUT   //21   // current state SAMPLING, next state SLEEP
     };
 
     // The messages used as events
@@ -201,6 +274,10 @@ protected:
     cMessage *DATAreceived;     // Type DATA_RECEIVED
     cMessage *ccaACKTimeout;    // Type CCA_ACK_TIMEOUT
     cMessage *ACKsent;          // Type ACK_SENT
+    // The messages events used for urgent packets
+    cMessage *strobeSent;       // Type STROBE_SENT
+    cMessage *sampleTimer;      // Type SAMPLE
+    cMessage *sampleTimeout;    // Type SAMPLE_TIMEOUT
 
     /** @name Help variables for the acknowledgment process. */
     /*@{*/
@@ -251,7 +328,150 @@ protected:
     double wakeupIntervalLook;
 
     bool useCorrection;
+    /**
+     * Compact headers: 1 byte of frame control, short addresses once the
+     * receiver assigned one in its WB & confirmed by the DATA, the timing
+     * fields as varints. The frame length is computed from these fields.
+     */
+    bool useCompactHeaders;
+    /** @brief sender: short address assigned by each receiver */
+    std::map<LAddress::L2Type, int> shortAddr;
+    /** @brief receiver: the sender uses the short address assigned to it */
+    bool *shortConfirmed;
+    /**
+     * Implicit ACK: the packets of class implicitAckClass or above are sent
+     * without ACK request, the next WB of the receiver confirms them with the
+     * sequence number of the last DATA it received from the sender.
+     */
+    bool useImplicitAck;
+    int implicitAckClass;
+    /** @brief sender: the last DATA did not request an ACK */
+    bool implicitAckSent;
+    /** @brief sender: packets sent without ACK request, kept until a WB confirms them */
+    MacQueue awaitingAck;
+    /** @brief sender: WBs that did not confirm a packet, by sequence number */
+    std::map<long, int> implicitTxAttempts;
+    long nbImplicitAcks;
+    long nbImplicitRetries;
+    /**
+     * Early sleep: the receiver sleeps as soon as every expected sender is
+     * served, an expected sender without DATA lostSenderTimeout after the WB
+     * is declared lost (0 = waitDATA).
+     */
+    bool useEarlySleep;
+    double lostSenderTimeout;
+    /** @brief receiver: end of the waitDATA window of the current wakeup */
+    simtime_t listenUntil;
+    /** @brief Ouput vector tracking the listen time saved per wakeup.*/
+    cOutVector listenSavedVec;
+    double listenSaved;
+    /**
+     * Real length: the DATA length follows the encapsulated packet instead of
+     * a fixed 16 bytes. A payload above maxFramePayload bytes (0 = never) is
+     * sent in fragments during one rendezvous like a frame pending burst &
+     * reassembled by the receiver.
+     */
+    bool useRealLength;
+    int maxFramePayload;
+    /** @brief sender: next fragment of the packet at the front of the queue */
+    int txFragment;
+    /** @brief receiver: packet being reassembled & next fragment expected of each sender */
+    long *fragSeq;
+    int *fragNext;
+    long nbTxFragments;
+    long nbReassembled;
+    /**
+     * Per destination queues: a WB from a receiver serves the oldest packets
+     * queued for it, the packets for other receivers wait for their own WB
+     * instead of blocking the front of the queue.
+     */
+    bool usePerDestQueues;
+    /** @brief sender: attempts of the packets set aside for another receiver */
+    std::map<LAddress::L2Type, int> destTxAttempts;
+    /**
+     * Urgent strobe: a packet of class urgentClass or below does not wait for
+     * its rendezvous, the sender repeats a STROBE every strobeInterval during
+     * one sampleInterval. A sleeping receiver listens sampleDuration every
+     * sampleInterval & answers a STROBE with an immediate WB.
+     */
+    bool useUrgentStrobe;
+    int urgentClass;
+    double sampleInterval;
+    double sampleDuration;
+    double strobeInterval;
+    /** @brief sender: a strobe train to strobeDest runs until strobeEnd */
+    bool strobing;
+    simtime_t strobeEnd;
+    LAddress::L2Type strobeDest;
+    /** @brief receiver: the current wakeup answers a STROBE */
+    bool urgentWake;
+    long nbStrobes;
+    long nbUrgentWakes;
+    long nbSamples;
+    double sampleTime;
+    /** @brief Ouput vector tracking the MAC delay of the urgent packets.*/
+    cOutVector urgentDelayVec;
+    /**
+     * Overheard WB: a sender waiting for its WB uses the WB of its receiver
+     * to another sender to keep listening while the receiver may still turn
+     * to it, or to sleep until its own predicted rendezvous.
+     */
+    bool useOverheardWB;
+    /** @brief WB times known by the sender for one receiver, -1 if unknown */
+    struct NeighborWB {
+        double lastOwn;
+        double lastHeard;
+        double busyUntil;
+        NeighborWB() : lastOwn(-1), lastHeard(-1), busyUntil(-1) {}
+    };
+    std::map<LAddress::L2Type, NeighborWB> neighborWB;
+    long nbOverheardWB;
+    long nbSkippedListen;
+    /**
+     * Backoff: the sender senses the channel before its DATA after a random
+     * backoff over 2^backoffExponent slots, the exponent starts from minBE
+     * sized on the senders expected by the receiver & grows up to maxBE at
+     * each busy CCA, up to maxCCAattempts CCA per rendezvous.
+     */
+    bool useBackoff;
+    double backoffSlot;
+    int minBE;
+    int maxBE;
+    int backoffExponent;
+    long nbCCAFailures;
+    /** @brief receiver: DATA lost while waiting for it */
+    long nbCollision;
+    /**
+     * Schedule hint: the application gives the send time of its next packet,
+     * the sender uses it as data interval & sends it in the DATA so that the
+     * receiver wakes up right after this packet.
+     */
+    bool useScheduleHint;
+    /** @brief sender: send time of the next packet of the application, -1 if unknown */
+    double nextSendTime;
+    /**
+     * Queue discipline: dropOldest keeps the newest packets when the queue is
+     * full, packets older than maxPacketAge are dropped before a DATA is sent
+     * (0 = never) & one destination holds at most destQueueLength packets
+     * (0 = no limit).
+     */
+    bool dropOldest;
+    double maxPacketAge;
+    int destQueueLength;
+    long nbExpired;
+    long nbDroppedOldest;
+    long nbDestDropped;
+    /**
+     * Priority: strict priority between trafficClasses classes set by the
+     * application, 0 is served first, each class limited to its own
+     * classQueueLength.
+     */
     bool usePriority;
+    int trafficClasses;
+    int *classQueueLength;
+    long *nbClassDropped;
+    /** @brief Ouput vector tracking the MAC delay of each class.*/
+    cOutVector *classDelayVec;
     bool useWBMiss;
     int numberWakeup;
     int sysClockFactor;
@@ -281,7 +501,83 @@ protected:
     LAddress::L2Type *routeTable;
     LAddress::L2Type receiverAddress;
 
-    static const int maxCCAattempts = 2;
+    /**
+     * Adaptive step controller: the step (in sysClock) grows additively after
+     * consecutive empty wakeups and shrinks multiplicatively on each hit.
+     */
+    bool useAdaptiveStep;
+    double stepIncrease;
+    double stepDecrease;
+    double stepMin;
+    double stepMax;
+    double *nodeStep;
+    int *nodeMissRun;
+    /** @brief Ouput vector tracking the step of each sender.*/
+    cOutVector *stepVec;
+
+    /**
+     * Latency SLO mode: the wakeup interval of each sender is capped so that
+     * the p95 of the MAC delay reported by the sender stays under its target.
+     */
+    bool useLatencySLO;
+    double *nodeTargetDelay;
+    double *nodeSloCap;
+    double **nodeDelay;
+    int *nodeDelayCount;
+    double *nodeP95;
+    /** @brief Ouput vector tracking the p95 MAC delay of each sender.*/
+    cOutVector *p95Vec;
+    static const int sloWindow = 20;
+    static const int sloMinSamples = 5;
+
+    /**
+     * Dormancy: after dormantThreshold consecutive empty wakeups a sender is
+     * considered silent and its interval doubles on each wakeup up to
+     * dormantMaxInterval, never below the interval it had; the first data
+     * received brings the interval back to the one used before the silence.
+     */
+    bool useDormancy;
+    int dormantThreshold;
+    double dormantMaxInterval;
+    int *nodeEmptyRun;
+    bool *nodeDormant;
+    double *nodeActiveInterval;
+    double *nodeDormantInterval;
+    long *nbDormant;
+    long *nbDormantResume;
+
+    /**
+     * Bootstrap of newly seen senders: the first bootstrapSamples piggybacked
+     * iwu are averaged to jump directly to the period & phase of the sender.
+     */
+    bool useBootstrap;
+    int bootstrapSamples;
+    int *nodeBootCount;
+    double *nodeBootSum;
+    bool *nodeBootDone;
+    /** @brief Moment the interval of each sender was first locked, -1 if never */
+    double *firstLockTime;
+
+    /**
+     * Age of information mode: the interval of a sender stays between the
+     * energy budget 1/aoiMaxWakeRate and its last reported period so that
+     * each reading is collected before the next one is generated.
+     */
+    bool useAoI;
+    double aoiMaxWakeRate;
+    double *nodePeriod;
+    double *nodeLastGen;
+    /** @brief Ouput vector tracking the peak age of information of each sender.*/
+    cOutVector *aoiVec;
+
+    /** @brief sender: sequence number of the next packet queued */
+    long seqNum;
+    /** @brief Last sequence number accepted from each sender, -1 if none */
+    long *lastSeq;
+    long nbRetransmissions;
+    long nbDuplicates;
+
+    int maxCCAattempts;
     int ccaAttempts;
 
     /** @brief Change MAC state */
@@ -296,9 +592,108 @@ protected:
     /** @brief Internal function to send an ACK */
     void sendMacAck();
 
+    /** @brief Internal function to send up the packets carried by a DATA */
+    void sendUpData(macpkttad_ptr_t mac);
+
+    /** @brief Return the number of fragments needed to send a queued packet */
+    int getFragmentCount(macpkt_ptr_t pkt);
+
+    /** @brief Store a fragment, return true if its packet is complete */
+    bool reassemble(int nodeId, macpkttad_ptr_t mac);
+
+    /** @brief Return false if the packet of this sender was already received */
+    bool acceptSequence(int nodeId, long seq);
+
+    /** @brief Drop the packets of the last DATA which reached maxTxAttempts */
+    void dropTxPackets();
+
+    /** @brief Return the traffic class of a packet */
+    int getPacketClass(cPacket *pkt);
+
+    /** @brief Make room in the queue for a packet of this class if allowed */
+    bool makeRoom(int trafficClass);
+
+    /** @brief Return true if the packet is sent with strobes */
+    bool isUrgent(cPacket *pkt);
+
+    /** @brief Start a strobe train for the first urgent packet of the queue */
+    bool startStrobes();
+
+    /** @brief Internal function to send one STROBE */
+    void sendStrobe();
+
+    /** @brief Put the urgent packet for dest right after the packets waiting for a retry */
+    void serveUrgent(const LAddress::L2Type& dest);
+
+    /** @brief Learn from a WB sent by a receiver to another sender */
+    void handleOverheardWB(macpkt_ptr_t wb);
+
+    /** @brief Size the contention window from the WB */
+    void startBackoff(cMessage *wb);
+
+    /** @brief Draw a random backoff in the contention window */
+    double getBackoff();
+
+    /** @brief Set the next wakeup of a sender from its schedule hint */
+    bool scheduleHintInterval(int nodeId, double nextSend, double iwu);
+
+    /** @brief Move the packets queued for dest to the front, false if none */
+    bool serveDestination(const LAddress::L2Type& dest);
+
+    /** @brief Return the number of packets queued for dest */
+    int countDestPackets(const LAddress::L2Type& dest);
+
+    /** @brief Return the adaptive WB timeout for one receiver */
+    double getDestWaitWB(const LAddress::L2Type& dest);
+
+    /** @brief Apply the queue discipline before queueing a packet for dest */
+    bool applyQueueDiscipline(const LAddress::L2Type& dest, int trafficClass, int& reason);
+
+    /** @brief Return true if the packet at it is a better victim of a drop than victim */
+    bool isDropVictim(MacQueue::iterator it, MacQueue::iterator victim, int trafficClass);
+
+    /** @brief Drop the expired packets, return true if the queue is not empty */
+    bool dropExpiredPackets();
+
+    /** @brief Drop one queued packet for the given reason */
+    MacQueue::iterator dropQueuedPacket(MacQueue::iterator it, int reason);
+
+    /** @brief Record the MAC delay of an acknowledged packet */
+    void recordClassDelay(macpkt_ptr_t pkt);
+
+    /** @brief Bits of a frame with compact headers carrying payload bits */
+    long getCompactLength(macpkt_ptr_t frame, long payload);
+
+    /** @brief Drop the packets a WB confirms, queue again the others sent to its source */
+    void confirmImplicitAcks(cMessage *wb);
+
+    /** @brief Return how long the receiver waits for the DATA after its WB */
+    double getWaitDATA();
+
+    /** @brief Record the listen time saved by sleeping before the end of waitDATA */
+    void recordListenSaved();
+
     /** @brief Internal function to send one WB */
     void sendWB();
 
+    /** @brief Store the rendezvous advertised in a WB or an ACK */
+    void updateRendezvous(cMessage *msg);
+
+    /** @brief Return the moment the sender has to wake up to send its data */
+    simtime_t getDataWakeup();
+
+    /** @brief Schedule the wakeup of the sender to send its data */
+    void scheduleDataWakeup();
+
+    /** @brief Return the time the sender listens for a WB */
+    double getWaitWB();
+
+    /** @brief Store the time the sender waited for the last WB */
+    void updateWaitWB(double wait);
+
+    /** @brief Predict the moment of the next WB from the receiver */
+    double predictRendezvous();
+
     /** @brief Internal function to attach a signal to the packet */
     void attachSignal(macpkt_ptr_t macPkt);
 
@@ -310,6 +705,26 @@ protected:
 
     void scheduleNextWakeup();
     void updateTSR(int nodeId, int value);
+    /** @brief Return the TSR value of a wakeup with data */
+    int getTSRValue(int packetCount);
+
+    /** @brief Return the step used to adapt the wakeup interval of a sender */
+    double getStep(int nodeId);
+    /** @brief Update the adaptive step after a wakeup with or without data */
+    void updateStep(int nodeId, bool received);
+
+    /** @brief Store a MAC delay sample of a sender & adapt its interval cap */
+    void updateLatencySLO(int nodeId, double delay);
+    /** @brief Detect silent senders & resume the ones sending again */
+    void updateDormancy(int nodeId, bool received);
+    /** @brief Jump to the period of a new sender once enough iwu are known */
+    bool bootstrapInterval(int nodeId, double idle, double iwu, double wbTime);
+    /** @brief Store the moment the interval of a sender is locked for the first time */
+    void markLocked(int nodeId);
+    /** @brief Track the age of information of a sender from a received frame */
+    void updateAoI(int nodeId, cPacket *pkt, double iwu);
+    /** @brief Apply the optional bounds on the next wakeup interval of a sender */
+    void boundInterval(int nodeId);
 
 
     virtual cObject* setUpControlInfo(cMessage *const pMsg, const LAddress::L2Type& pSrcAddr);
@@ -1,12 +1,37 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <omnetpp.h>
 
 const double PKG_WB_SIZE=7;
 const double PKG_ACK_SIZE=11;
 const double PKG_DATA_SIZE=24;
 
-std::vector<int> &split(const std::string &s, char delim, std::vector<int> &elems) {
+// compact headers: 1 byte of frame control & 2 bytes of FCS
+const int COMPACT_FRAME_SIZE=3;
+// compact headers: one full address, or one short address assigned by the receiver
+const int FULL_ADDR_SIZE=2;
+const int SHORT_ADDR_SIZE=1;
+
+// drop reasons of the MAC queue disciplines, after DroppedPacket::Reasons
+const int DROP_EXPIRED=100;
+const int DROP_OLDEST=101;
+const int DROP_DEST_LIMIT=102;
+
+/**
+ * Number of bytes of a varint: 7 bits per byte, the sign zigzag encoded.
+ */
+inline int varintLength(long value) {
+    unsigned long v = value < 0 ? ((unsigned long) ~value << 1) | 1 : (unsigned long) value << 1;
+    int bytes = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+inline std::vector<int> &split(const std::string &s, char delim, std::vector<int> &elems) {
     std::stringstream ss(s);
     std::string item;
     while (std::getline(ss, item, delim)) {
@@ -16,8 +41,34 @@ std::vector<int> &split(const std::string &s, char delim, std::vector<int> &elem
 }
 
 
-std::vector<int> split(const std::string &s, char delim) {
+inline std::vector<int> split(const std::string &s, char delim) {
     std::vector<int> elems;
     split(s, delim, elems);
     return elems;
 }
+
+
+/**
+ * Traffic class attached by the application to a packet, searched along the
+ * encapsulation chain because the network layer drops the control info.
+ */
+inline int getTrafficClass(cPacket *pkt) {
+    for (; pkt != NULL; pkt = pkt->getEncapsulatedPacket()) {
+        if (pkt->hasPar("trafficClass")) {
+            return pkt->par("trafficClass").longValue();
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send time of the next packet planned by the application, -1 if unknown.
+ */
+inline double getNextSendTime(cPacket *pkt) {
+    for (; pkt != NULL; pkt = pkt->getEncapsulatedPacket()) {
+        if (pkt->hasPar("nextSendTime")) {
+            return pkt->par("nextSendTime").doubleValue();
+        }
+    }
+    return -1;
+}